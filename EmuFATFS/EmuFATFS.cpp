@@ -9,6 +9,7 @@
 #include "fatfs.h"
 
 #include <ctype.h>
+#include <stddef.h>
 
 #ifdef DEBUG
 #   define cretassure(cond, errstr ...) do{ if ((cond) == 0){err=__LINE__;printf(errstr); goto error;} }while(0)
@@ -23,25 +24,74 @@
 using namespace tihmstar;
 
 
-#define BYTES_PER_SECTOR _bytesPerSector
-#define SECTORS_PER_CLUSTER 128 //128 max allowed value
+/*
+    Geometry is stored as shifts, so that none of the offset math below compiles to a division
+ */
+#define BYTES_PER_SECTOR (1u << _bytesPerSectorShift)
+#define SECTORS_PER_CLUSTER (1u << _sectorsPerClusterShift) //128 max allowed value
 
-#define RESERVED_SECTORS_CNT 1
-#define SECTORS_PER_FAT static_cast<uint16_t>(0x20000 / BYTES_PER_SECTOR)
-#define SECTORS_PER_ROOT_DIRECTORY (0x10000*2 / BYTES_PER_SECTOR)
+/*
+    Everything depending on the volume type and the file layout is computed by updateGeometry()
+ */
+#define IS_FAT32 (_volumeType == kVolumeTypeFAT32)
+#define IS_EXFAT (_volumeType == kVolumeTypeExFAT)
+#define RESERVED_SECTORS_CNT _reservedSectors
+#define NUMBER_OF_FATS (IS_EXFAT ? 1 : 2)
+#define SECTORS_PER_FAT _sectorsPerFAT
+#define SECTORS_PER_ROOT_DIRECTORY _rootDirectorySectors
 
 #define SECTOR_BOOTSECTOR       (0)
 #define SECTOR_FAT_1            (RESERVED_SECTORS_CNT)
 #define SECTOR_FAT_2            (RESERVED_SECTORS_CNT + SECTORS_PER_FAT)
-#define SECTOR_ROOT_DIRECTORY   (SECTOR_FAT_2 + SECTORS_PER_FAT)
+#define SECTOR_ROOT_DIRECTORY   (SECTOR_FAT_1 + NUMBER_OF_FATS*SECTORS_PER_FAT)
 #define SECTOR_DATA_REGION      (SECTOR_ROOT_DIRECTORY + SECTORS_PER_ROOT_DIRECTORY)
+#define SECTOR_OFFSET(s)        ((uint64_t)(s) << _bytesPerSectorShift)
 
-#define BYTES_PER_CLUSTER (BYTES_PER_SECTOR*SECTORS_PER_CLUSTER)
+#define BYTES_PER_CLUSTER (1u << (_bytesPerSectorShift + _sectorsPerClusterShift))
+#define CLUSTER_SHIFT (_bytesPerSectorShift + _sectorsPerClusterShift)
 #define FIRST_DATA_CLUSTER      2
 
-#define TOTAL_SECTORS static_cast<uint32_t>(FAT16_THRESHOLD*512/BYTES_PER_SECTOR*SECTORS_PER_CLUSTER)
+#define FAT16_CLUSTER_LIMIT 0xFFF7 //first reserved cluster number
+#define FAT32_CLUSTER_LIMIT 0x0FFFFFF7
+#define EXFAT_CLUSTER_LIMIT 0xFFFFFFF7
+
+//FAT32 and exFAT keep the root directory as a cluster chain at the start of the data region
+#define ROOT_DIRECTORY_BYTES (_rootDirectoryClusters ? ((uint64_t)_rootDirectoryClusters << CLUSTER_SHIFT) : kRootDirectoryBytes)
+#define ROOT_DIRECTORY_FIXED_ENTRIES (IS_EXFAT ? 3 : 1) //volume label (exFAT: + bitmap + up-case table)
+
+//exFAT puts the up-case table behind the root directory, files start after it
+#define UPCASE_CLUSTER          (FIRST_DATA_CLUSTER + _rootDirectoryClusters)
+#define FIRST_FILE_CLUSTER      (UPCASE_CLUSTER + (IS_EXFAT ? 1 : 0))
+
+#define TOTAL_SECTORS _totalSectors
+
+//stats hooks, the clock is only registered together with _stats
+#define STATS_ACTIVE (kStatsEnabled && _stats)
+#define STATS_LATENCY(hist, startTicks) do { if (kStatsEnabled && _statsClock) recordLatency(&_stats->hist, startTicks); } while(0)
 
 #pragma mark helpers
+/*
+    Minimal compressed exFAT up-case table: identity except for a-z.
+    0xFFFF introduces a run of identity mapped characters.
+ */
+static const uint16_t gExFATUpcaseTable[] = {
+    0xFFFF, 0x0061,
+    'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T','U','V','W','X','Y','Z',
+    0xFFFF, 0xFF85,
+};
+
+static uint8_t log2_floor(uint32_t v){
+  uint8_t ret = 0;
+  while (v >>= 1) ret++;
+  return ret;
+}
+
+static const char *gBadFilenameChars = "*?<>|\"\\/:";
+
+static inline bool isWritable(const EmuFATFSBase::FileEntry *cfe){
+  return cfe->f_write || cfe->f_writeCtx || cfe->f_writeAsync;
+}
+
 static uint8_t lfn_checksum(const char *filename){
   uint8_t ret = filename[0];
   size_t filenamelen = 11;
@@ -52,19 +102,99 @@ static uint8_t lfn_checksum(const char *filename){
   return ret;
 }
 
+/*
+    Zero for an empty slot, so fresh shadow storage matches a zeroed directory.
+    The rotations keep a change confined to one word from cancelling out, only the final fold can collide.
+ */
+static uint32_t slot_checksum(const void *entry){
+  uint64_t words[4] = {};
+  uint64_t csum = 0;
+  memcpy(words, entry, sizeof(words));
+  csum = (words[0] ^ (words[1] << 16 | words[1] >> 48) ^ (words[2] << 32 | words[2] >> 32) ^ (words[3] << 48 | words[3] >> 16)) * 0x9E3779B97F4A7C15;
+  return static_cast<uint32_t>(csum >> 32) ^ static_cast<uint32_t>(csum);
+}
+
+//skips the first character, which the host overwrites with 0xe5 on delete
+static uint16_t short_name_hash(const char *shortName){
+  uint16_t ret = 0;
+  for (int i = 1; i < 11; i++){
+    ret = ret*31 + (uint8_t)shortName[i];
+  }
+  return ret;
+}
+
+static void fat16_fill_chain(uint16_t *fe, uint16_t next, uint32_t cnt){
+  /*
+    A chain is just an incrementing sequence, so emit 4 entries per 64bit store
+   */
+  uint64_t lanes = (uint64_t)next | ((uint64_t)(uint16_t)(next+1) << 16) | ((uint64_t)(uint16_t)(next+2) << 32) | ((uint64_t)(uint16_t)(next+3) << 48);
+  for (; cnt >= 4; cnt -= 4) {
+    memcpy(fe, &lanes, sizeof(lanes));
+    lanes += 0x0004000400040004;
+    fe += 4;
+    next += 4;
+  }
+  while (cnt--) *fe++ = next++;
+}
+
+static uint32_t exfat_checksum32(uint32_t csum, uint8_t byte){
+  return ((csum & 1) ? 0x80000000 : 0) + (csum >> 1) + byte;
+}
+
+static uint16_t exfat_checksum16(uint16_t csum, uint8_t byte){
+  return ((csum & 1) ? 0x8000 : 0) + (csum >> 1) + byte;
+}
+
+static void bitmap_set_range(uint8_t *bm, uint32_t bit, uint32_t cnt){
+  for (; cnt && (bit & 7); bit++, cnt--) bm[bit >> 3] |= 1 << (bit & 7);
+  memset(&bm[bit >> 3], 0xff, cnt >> 3);
+  bit += cnt & ~7u; cnt &= 7;
+  for (; cnt; bit++, cnt--) bm[bit >> 3] |= 1 << (bit & 7);
+}
+
+static void fat32_fill_chain(uint32_t *fe, uint32_t next, uint32_t cnt){
+  uint64_t lanes = (uint64_t)next | ((uint64_t)(next+1) << 32);
+  for (; cnt >= 2; cnt -= 2) {
+    memcpy(fe, &lanes, sizeof(lanes));
+    lanes += 0x0000000200000002;
+    fe += 2;
+    next += 2;
+  }
+  if (cnt) *fe = next;
+}
+
 
 #pragma mark EmuFATFS
-EmuFATFSBase::EmuFATFSBase(FileEntry *fileStorage, uint16_t maxFileStorageEntires, char *filenamesBuf, size_t filenamesBufSize, const char *volumeLabel, uint16_t bytesPerSector)
+EmuFATFSBase::EmuFATFSBase(FileEntry *fileStorage, uint16_t *clusterIndexStorage, uint16_t maxFileStorageEntires, char *filenamesBuf, size_t filenamesBufSize, FAT_DirectoryTableEntry_t *rootDirectoryStorage, uint16_t maxRootDirectoryEntries, uint32_t *rootShadowStorage, uint16_t rootShadowSlots, uint16_t *nameBucketStorage, uint16_t nameBucketCount, FAT_DirectoryTableEntry_t *directoryCacheStorage, uint16_t maxDirectoryCacheEntries, ChainExtent *chainStorage, uint16_t maxChainExtents, const char *volumeLabel, uint16_t bytesPerSector, uint8_t sectorsPerCluster, VolumeType volumeType)
 : _fileStorage{fileStorage}, _maxFileStorageEntires{maxFileStorageEntires}, _usedFiles{0}
+, _clusterIndex{clusterIndexStorage}, _clusterIndexCnt{0}
+, _rootDirectoryCache{rootDirectoryStorage}, _rootDirectoryCacheSize{maxRootDirectoryEntries}, _rootDirectoryEntries{1}, _rootDirectoryCacheValid{false}, _rootFirstChild{kNoFile}, _rootLastChild{kNoFile}
+, _rootShadow{rootShadowStorage}, _rootShadowSlots{rootShadowSlots}, _rootShadowGenerated{0}, _nameBuckets{nameBucketStorage}, _nameBucketCount{nameBucketCount}
+, _directoryCache{directoryCacheStorage}, _directoryCacheSize{maxDirectoryCacheEntries}, _directoryCacheOwner{kNoFile}, _lastDirectory{kNoFile}
+, _chainExtents{chainStorage}, _maxChainExtents{maxChainExtents}, _chainExtentsCnt{0}, _chainsDirty{false}
+, _writeBuffer{NULL}, _writeBufferSize{0}, _writeBlockSize{0}, _writeBufferFile{kNoFile}, _writeBufferBase{0}, _writeBufferStart{0}, _writeBufferEnd{0}, _writeStats{}
+, _readAheadSlots{NULL}, _readAheadSlotCount{0}, _readAheadSlotSize{0}
+, _readCacheBlocks{NULL}, _readCacheBlockCount{0}, _readCacheIndex{NULL}, _readCacheIndexSize{0}, _readCacheHand{0}, _readCacheBlockSize{0}, _readCacheStats{}
+, _requests{NULL}, _requestDepth{0}, _requestNext{0}, _requestCount{0}, _syncRequest{}
+, _stats{NULL}, _fileStats{NULL}, _fileStatsCnt{0}, _statsClock{NULL}
+, _traceCb{NULL}, _traceCtx{NULL}, _traceClock{NULL}
 , _filenamesBuf{filenamesBuf}, _filenamesBufSize{filenamesBufSize}, _usedFilenamesBytes{0}
-, _bytesPerSector(bytesPerSector)
+, _volumeType{volumeType}, _bytesPerSectorShift(log2_floor(bytesPerSector)), _sectorsPerClusterShift(sectorsPerCluster ? log2_floor(sectorsPerCluster) : kMaxSectorsPerClusterShift)
+, _reservedSectors{0}, _sectorsPerFAT{0}, _rootDirectorySectors{0}, _rootDirectoryClusters{0}, _totalSectors{0}, _clusterLimit{0}, _clusterHighWater{FIRST_DATA_CLUSTER}, _volumeBytes{kFAT32DefaultVolumeBytes}, _bitmapCluster{0}, _bitmapClusters{0}
+, _adaptiveClusterSize{sectorsPerCluster == 0}, _layoutPending{false}, _layoutFinalized{false}, _sharedReaders{false}
+, _generation{0}, _updateDepth{0}, _updateChanged{false}, _inNewfileCallback{false}
 , _volumeLabel{}, _nextFreeCluster{FIRST_DATA_CLUSTER}
+, _newfilecb{NULL}, _newfilecbCtx{NULL}, _newfilecbCtxArg{NULL}
 {
+    updateGeometry();
+    _nextFreeCluster = FIRST_FILE_CLUSTER;
+    _rootDirectoryEntries = ROOT_DIRECTORY_FIXED_ENTRIES;
+
     memset(_volumeLabel, ' ', sizeof(_volumeLabel));
     if (volumeLabel){
         strncpy(_volumeLabel, volumeLabel, sizeof(_volumeLabel));
     }else{
-        strncpy(_volumeLabel, "EmuFATFS16", sizeof(_volumeLabel));
+        strncpy(_volumeLabel, IS_EXFAT ? "EmuExFATFS" : (IS_FAT32 ? "EmuFATFS32" : "EmuFATFS16"), sizeof(_volumeLabel));
     }
     
     for (int i=0; i<sizeof(_volumeLabel)-1; i++){
@@ -82,120 +212,439 @@ EmuFATFSBase::~EmuFATFSBase(){
 
 #pragma mark private
 
-const EmuFATFSBase::FileEntry *EmuFATFSBase::getFileForSector(uint16_t sector){
-    for (int i=0; i<_usedFiles; i++) {
-        const FileEntry *cur = &_fileStorage[i];
-        if (cur->f_read == NULL) break;
-        uint16_t usedSectors = (cur->fileSize/BYTES_PER_SECTOR);
-        if (cur->fileSize & (BYTES_PER_SECTOR-1)) usedSectors++;
-        if (cur->startCluster+RESERVED_SECTORS_CNT <= sector && usedSectors > sector) {
-            return cur;
+uint32_t EmuFATFSBase::clustersForSize(uint64_t size){
+    uint32_t clusters = static_cast<uint32_t>(size >> CLUSTER_SHIFT);
+    if (size & (BYTES_PER_CLUSTER-1)) clusters++;
+    if (!clusters) clusters = 1;
+    return clusters;
+}
+
+void EmuFATFSBase::indexFile(uint16_t fileIdx){
+    const FileEntry *cfe = &_fileStorage[fileIdx];
+    if (cfe->startCluster < FIRST_DATA_CLUSTER) return;
+    
+    /*
+        Files are usually added with ascending clusters, so this is almost always an append
+     */
+    uint16_t pos = _clusterIndexCnt;
+    while (pos > 0 && _fileStorage[_clusterIndex[pos-1]].startCluster > cfe->startCluster) {
+        _clusterIndex[pos] = _clusterIndex[pos-1];
+        pos--;
+    }
+    _clusterIndex[pos] = fileIdx;
+    _clusterIndexCnt++;
+    if (cfe->startCluster + cfe->clusterCount > _clusterHighWater) _clusterHighWater = cfe->startCluster + cfe->clusterCount;
+}
+
+void EmuFATFSBase::rebuildClusterIndex(){
+    _clusterIndexCnt = 0;
+    for (uint16_t i=0; i<_usedFiles; i++) {
+        indexFile(i);
+    }
+}
+
+uint16_t EmuFATFSBase::clusterIndexUpperBound(uint32_t cluster){
+    uint16_t lo = 0;
+    uint16_t hi = _clusterIndexCnt;
+    
+    //number of files which start at or before cluster
+    while (lo < hi) {
+        uint16_t mid = lo + (hi-lo)/2;
+        if (_fileStorage[_clusterIndex[mid]].startCluster <= cluster) {
+            lo = mid+1;
+        }else{
+            hi = mid;
         }
     }
-    return NULL;
+    return lo;
 }
 
-int32_t EmuFATFSBase::readFileAllocationTable(uint32_t offset, void *buf, uint32_t size){
+EmuFATFSBase::FileEntry *EmuFATFSBase::getFileForCluster(uint32_t cluster){
+    uint16_t lo = clusterIndexUpperBound(cluster);
+    if (lo == 0) return NULL;
+    
+    FileEntry *cfe = &_fileStorage[_clusterIndex[lo-1]];
+    if (cluster - cfe->startCluster >= cfe->clusterCount) return NULL;
+    return cfe;
+}
+
+bool EmuFATFSBase::isEmulatedCluster(uint32_t cluster){
+    const FileEntry *cfe = NULL;
+    if (cluster - FIRST_DATA_CLUSTER < _rootDirectoryClusters) return true;
+    cfe = getFileForCluster(cluster);
+    return cfe && !cfe->isDynamicFile;
+}
+
+uint16_t EmuFATFSBase::chainExtentUpperBound(uint32_t cluster){
+    uint16_t lo = 0;
+    uint16_t hi = _chainExtentsCnt;
+    
+    //number of extents which start at or before cluster
+    while (lo < hi) {
+        uint16_t mid = lo + (hi-lo)/2;
+        if (_chainExtents[mid].startCluster <= cluster) {
+            lo = mid+1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int EmuFATFSBase::eraseChainExtents(uint32_t startCluster, uint32_t endCluster){
     int err = 0;
-    int32_t didRead = 0;
-    uint16_t *fe = (uint16_t*)buf;
-    uint16_t findex = offset/2;
+    uint16_t i = chainExtentUpperBound(startCluster);
+    if (i) i--;
+    
+    while (i < _chainExtentsCnt && _chainExtents[i].startCluster < endCluster) {
+        ChainExtent *ext = &_chainExtents[i];
+        uint32_t extEnd = ext->startCluster + ext->clusterCount;
+        if (extEnd <= startCluster) {
+            i++;
+            continue;
+        }
+        _chainsDirty = true;
+        if (ext->startCluster < startCluster) {
+            //keep the front, it now continues into the erased range
+            if (extEnd > endCluster) {
+                cretassure(_chainExtentsCnt < _maxChainExtents, "Not enough chain extents left");
+                memmove(&_chainExtents[i+2], &_chainExtents[i+1], (_chainExtentsCnt-i-1)*sizeof(*ext));
+                _chainExtents[i+1] = {endCluster, extEnd - endCluster, ext->next, 0, kNoFile};
+                _chainExtentsCnt++;
+            }
+            ext->clusterCount = startCluster - ext->startCluster;
+            ext->next = startCluster;
+            i++;
+        }else if (extEnd > endCluster) {
+            ext->clusterCount = extEnd - endCluster;
+            ext->startCluster = endCluster;
+            break;
+        }else{
+            memmove(ext, ext+1, (_chainExtentsCnt-i-1)*sizeof(*ext));
+            _chainExtentsCnt--;
+        }
+    }
+    
+error:
+    return -err;
+}
 
-    cretassure((size & 1) == 0, "read size needs to be 2 bytes aligned!");
-    cretassure((offset & 1) == 0, "offset needs to be 2 bytes aligned!");
+int EmuFATFSBase::storeChainExtent(uint32_t startCluster, uint32_t clusterCount, uint32_t next){
+    int err = 0;
+    uint16_t i = 0;
+    ChainExtent *ext = NULL;
+
+    cretassure(!eraseChainExtents(startCluster, startCluster + clusterCount), "Failed to erase chain extents");
+    if (!next) goto error; //free clusters are simply not tracked
+    
+    i = chainExtentUpperBound(startCluster);
+    if (i && _chainExtents[i-1].startCluster + _chainExtents[i-1].clusterCount == startCluster && _chainExtents[i-1].next == startCluster) {
+        ext = &_chainExtents[--i];
+        ext->clusterCount += clusterCount;
+        ext->next = next;
+    }else{
+        cretassure(_chainExtentsCnt < _maxChainExtents, "Not enough chain extents left");
+        memmove(&_chainExtents[i+1], &_chainExtents[i], (_chainExtentsCnt-i)*sizeof(*ext));
+        _chainExtentsCnt++;
+        ext = &_chainExtents[i];
+        *ext = {startCluster, clusterCount, next, 0, kNoFile};
+    }
+    _chainsDirty = true;
+
+    //and glue the following extent on, if this one continues into it
+    if (i+1 < _chainExtentsCnt && ext->next == ext->startCluster + ext->clusterCount && _chainExtents[i+1].startCluster == ext->next) {
+        ext->clusterCount += _chainExtents[i+1].clusterCount;
+        ext->next = _chainExtents[i+1].next;
+        memmove(&_chainExtents[i+1], &_chainExtents[i+2], (_chainExtentsCnt-i-2)*sizeof(*ext));
+        _chainExtentsCnt--;
+    }
+    
+error:
+    return -err;
+}
+
+void EmuFATFSBase::resolveChains(){
+    bool indexChanged = false;
+    _chainsDirty = false;
+    
+    for (uint16_t i=0; i<_chainExtentsCnt; i++) {
+        _chainExtents[i].fileIdx = kNoFile;
+    }
+    
+    /*
+        Walk the chain of every dynamic file which starts in a host written extent.
+        Such a file is described by its chain alone, so it leaves the (contiguous) cluster index.
+     */
+    for (uint16_t f=0; f<_usedFiles; f++) {
+        FileEntry *cfe = &_fileStorage[f];
+        uint32_t cluster = cfe->startCluster;
+        uint32_t fileCluster = 0;
+        uint16_t i = 0;
+        if (!cfe->isDynamicFile) continue;
+        
+        i = chainExtentUpperBound(cluster);
+        if (!i || cluster - _chainExtents[i-1].startCluster >= _chainExtents[i-1].clusterCount) {
+            if (!cfe->clusterCount) {
+                cfe->clusterCount = clustersForSize(cfe->fileSize);
+                indexChanged = true;
+            }
+            continue;
+        }
+        if (cfe->clusterCount) {
+            cfe->clusterCount = 0;
+            indexChanged = true;
+        }
+        
+        for (uint16_t steps=0; i && steps < _chainExtentsCnt; steps++) {
+            ChainExtent *ext = &_chainExtents[i-1];
+            if (cluster - ext->startCluster >= ext->clusterCount || ext->fileIdx != kNoFile) break;
+            ext->fileIdx = f;
+            ext->fileCluster = fileCluster - (cluster - ext->startCluster);
+            fileCluster += ext->startCluster + ext->clusterCount - cluster;
+            cluster = ext->next;
+            i = chainExtentUpperBound(cluster);
+        }
+    }
     
-#define putentry(idx, val) \
-        if (findex == idx) \
-            do { \
-                if (size < sizeof(*fe)) goto error; \
-                *fe++ = val; size -= 2; didRead+=2; findex++;\
-            } while (0)
+    if (indexChanged) rebuildClusterIndex();
+}
+
+uint16_t EmuFATFSBase::longFilenameLength(const FileEntry *cfe){
+    uint16_t len = cfe->filenameLenNoSuffix;
+    if (cfe->filename[cfe->filenameLenNoSuffix+1] != ' '){
+      len+=2;
+      for (int j=1; j<3; j++) {
+          if (cfe->filename[cfe->filenameLenNoSuffix+1+j] == ' ') break;
+          len++;
+      }
+    }
+    return len;
+}
+
+uint8_t EmuFATFSBase::lfnEntriesForFile(const FileEntry *cfe){
+    return (longFilenameLength(cfe) + LFN_ENTRY_MAX_NAME_LEN-1) / LFN_ENTRY_MAX_NAME_LEN;
+}
+
+uint8_t EmuFATFSBase::directoryEntriesForFile(const FileEntry *cfe){
+    if (IS_EXFAT) {
+        //file + stream extension + name entries
+        return 2 + (longFilenameLength(cfe) + EXFAT_FILENAME_ENTRY_MAX_NAME_LEN-1) / EXFAT_FILENAME_ENTRY_MAX_NAME_LEN;
+    }
+    return 1 + lfnEntriesForFile(cfe);
+}
+
+int32_t EmuFATFSBase::readFileAllocationTable(uint32_t offset, void *buf, uint32_t size){
+    int err = 0;
+    uint8_t *fe = (uint8_t*)buf;
+    const uint8_t entryShift = IS_FAT32 || IS_EXFAT ? 2 : 1;
+    const uint32_t endOfChain = IS_EXFAT ? 0xFFFFFFFF : (IS_FAT32 ? 0x0FFFFFFF : 0xFFFF);
+    uint32_t findex = offset >> entryShift;
+    const uint32_t fstart = findex;
+    uint32_t fend = 0;
+    uint16_t i = 0;
+    uint64_t statsStart = statsTicks();
+
+#define putentry(val) do { if (entryShift == 2) {uint32_t v = (val); memcpy(fe, &v, 4);} else {uint16_t v = (val); memcpy(fe, &v, 2);} fe += 1u << entryShift; findex++; } while(0)
+    cretassure((size & ((1u << entryShift)-1)) == 0, "read size needs to be entry aligned!");
+    cretassure((offset & ((1u << entryShift)-1)) == 0, "offset needs to be entry aligned!");
     
+    if (offset + size > SECTORS_PER_FAT*BYTES_PER_SECTOR) size = SECTORS_PER_FAT*BYTES_PER_SECTOR - offset;
+    fend = findex + (size >> entryShift);
     
-    putentry(0, 0xfff8);//FAT16 type  (boot sector)
-    putentry(1, 0x8000);//FAT16 type  (volume label)
+    if (findex == 0 && findex < fend) {
+        putentry(IS_EXFAT ? 0xFFFFFFF8 : (IS_FAT32 ? 0x0FFFFFF8 : 0xfff8)); //media type  (boot sector)
+    }
+    if (findex == 1 && findex < fend) {
+        putentry(IS_FAT32 || IS_EXFAT ? endOfChain : 0x8000); //FAT16 type  (volume label)
+    }
 
-    for (int i=0; i<_usedFiles; i++) {
-        const FileEntry *cur = &_fileStorage[i];
+    {
+        /*
+            Emit the chain of one extent, clipped to [findex, fend)
+         */
+        auto putextent = [&](uint32_t startCluster, uint32_t clusterCount){
+            uint32_t lastCluster = startCluster + clusterCount - 1;
+        
+            if (lastCluster < findex) return;
+            if (startCluster > findex) {
+                uint32_t gap = (startCluster < fend ? startCluster : fend) - findex;
+                memset(fe, 0, gap << entryShift);
+                fe += gap << entryShift; findex += gap;
+            }
         
-        uint16_t usedClusters = (cur->fileSize/(BYTES_PER_SECTOR*SECTORS_PER_CLUSTER));
-        if (cur->fileSize & ((BYTES_PER_SECTOR*SECTORS_PER_CLUSTER)-1)) usedClusters++;
-        if (!usedClusters) usedClusters = 1;
+            if (findex < lastCluster) {
+                uint32_t chainLen = (lastCluster < fend ? lastCluster : fend) - findex;
+                if (entryShift == 2) {
+                    fat32_fill_chain((uint32_t*)fe, findex+1, chainLen);
+                }else{
+                    fat16_fill_chain((uint16_t*)fe, static_cast<uint16_t>(findex+1), chainLen);
+                }
+                fe += chainLen << entryShift; findex += chainLen;
+            }
         
-        if (usedClusters) {
-            for (int32_t z = 0; z<usedClusters-1; z++) {
-                if (size < sizeof(*fe)) goto error;
-                if (cur->startCluster + z != findex) continue;
-                *fe++ = ++findex; didRead+=2; size-=2;
+            if (findex == lastCluster && findex < fend) {
+                putentry(endOfChain);
             }
+        };
 
-            if (size < sizeof(*fe)) goto error;
-            if (cur->startCluster + usedClusters-1 != findex) continue;
-            *fe++ = 0xFFFF; didRead+=2; size-=2;
-            findex++;
+        if (_rootDirectoryClusters && findex < fend) {
+            putextent(FIRST_DATA_CLUSTER, _rootDirectoryClusters);
+        }
+
+        if (IS_EXFAT) {
+            /*
+                Files are contiguous and marked NoFatChain, only the up-case table and bitmap have chains
+             */
+            if (findex < fend) putextent(UPCASE_CLUSTER, 1);
+            if (findex < fend) putextent(_bitmapCluster, _bitmapClusters);
+        }else{
+            /*
+                Start at the file covering (or following) the first requested entry and only walk
+                the extents which intersect the requested window
+             */
+            i = clusterIndexUpperBound(findex);
+            if (i) i--;
+            for (; i<_clusterIndexCnt && findex < fend; i++) {
+                const FileEntry *cur = &_fileStorage[_clusterIndex[i]];
+                putextent(cur->startCluster, cur->clusterCount);
+            }
         }
-    }
     
-    if (offset + size > SECTORS_PER_FAT*BYTES_PER_SECTOR) size = SECTORS_PER_FAT*BYTES_PER_SECTOR - didRead - offset;
-    memset(fe, 0, size); didRead += size;
+        memset(fe, 0, (fend-findex) << entryShift);
+
+        /*
+            Chains the host wrote for clusters we don't emulate go on top
+         */
+        i = chainExtentUpperBound(fstart);
+        if (i) i--;
+        for (; i<_chainExtentsCnt && _chainExtents[i].startCluster < fend; i++) {
+            const ChainExtent *ext = &_chainExtents[i];
+            uint32_t start = ext->startCluster > fstart ? ext->startCluster : fstart;
+            uint32_t end = ext->startCluster + ext->clusterCount;
+            uint8_t *dst = NULL;
+            if (end > fend) end = fend;
+            if (start >= end) continue;
+            
+            dst = (uint8_t*)buf + ((start - fstart) << entryShift);
+            if (entryShift == 2) {
+                fat32_fill_chain((uint32_t*)dst, start+1, end - start);
+            }else{
+                fat16_fill_chain((uint16_t*)dst, static_cast<uint16_t>(start+1), end - start);
+            }
+            if (end == ext->startCluster + ext->clusterCount) {
+                fe = dst + ((end - 1 - start) << entryShift);
+                putentry(ext->next);
+            }
+        }
+    }
     
 error:
     if (err) {
         return -err;
     }
-    return didRead;
+    STATS_LATENCY(fileAllocationTable, statsStart);
+    return size;
 #undef putentry
 }
 
 int32_t EmuFATFSBase::readBootsector(uint32_t offset, void *buf, uint32_t size){
+    if (IS_EXFAT) return readExFATBootRegion(offset, buf, size);
     int err = 0;
     int32_t didRead = 0;
     uint8_t *ptr = (uint8_t*)buf;
     FAT_Bootsector_t bs = {};
-            
-    *(uint32_t*)bs.jumpInsn = 0x00903ceb;
-    memcpy(bs.oemName, "EmuFATFS", sizeof(bs.oemName));
-    
-    bs.dos4 = {
-        .dos3 = {
-            .dos2 = {
-                .bytesPerSector = BYTES_PER_SECTOR,
-                .sectorsPerCluster = SECTORS_PER_CLUSTER, //128 is maximum
-                .reservedSectors = RESERVED_SECTORS_CNT,
-                .numberOfFATs = 2, //keep this to "2" for compatibility reasons
-                .rootdirectoryEntries = static_cast<uint16_t>(SECTORS_PER_FAT*BYTES_PER_SECTOR / 32),
-                .totalSectors = 0, //more than 0x10000 sectors
-                .mediaDescriptor = 0xF8, //"fixed disk" (i.e. partition on a hard drive)
-                .sectorsPerFAT = SECTORS_PER_FAT,
-            },
-            .physSectorsPerTrack = 1,
-            .numberOfHeads = 1,
-            .hiddenSectors = 0,
-            .largeTotalSectors = TOTAL_SECTORS,
+    FAT_FSInfo_t fsi = {};
+    const FAT_BPB_DOS3_31_t dos3 = {
+        .dos2 = {
+            .bytesPerSector = static_cast<uint16_t>(BYTES_PER_SECTOR),
+            .sectorsPerCluster = static_cast<uint8_t>(SECTORS_PER_CLUSTER), //128 is maximum
+            .reservedSectors = static_cast<uint16_t>(RESERVED_SECTORS_CNT),
+            .numberOfFATs = 2, //keep this to "2" for compatibility reasons
+            .rootdirectoryEntries = static_cast<uint16_t>(SECTORS_PER_ROOT_DIRECTORY*BYTES_PER_SECTOR / 32),
+            .totalSectors = 0, //more than 0x10000 sectors
+            .mediaDescriptor = 0xF8, //"fixed disk" (i.e. partition on a hard drive)
+            .sectorsPerFAT = static_cast<uint16_t>(IS_FAT32 ? 0 : SECTORS_PER_FAT),
         },
-        .physDriveNumber = 0,
-        .flags = 0,
-        .extendedBootSignature = 0x29,
-        .volumeSerialNumber = 0x6d686974,
-        .volumeLabel = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-        .filesystemType = {'F', 'A', 'T', '1', '6', ' ', ' ', ' '},
+        .physSectorsPerTrack = 1,
+        .numberOfHeads = 1,
+        .hiddenSectors = 0,
+        .largeTotalSectors = TOTAL_SECTORS,
     };
-    memcpy(&bs.dos4.volumeLabel, _volumeLabel, sizeof(bs.dos4.volumeLabel));
-    bs.signature = 0xaa55;
     
-    if (offset < sizeof(bs)) {
-        size_t doCopy = sizeof(bs) - offset;
-        if (doCopy > size) doCopy = size;
-        memcpy(ptr, ((uint8_t*)&bs)+offset, doCopy);
-        ptr += doCopy;
-        size -= doCopy;
-        didRead += doCopy;
-    }
+    memcpy(bs.oemName, "EmuFATFS", sizeof(bs.oemName));
+    if (IS_FAT32) {
+        uint32_t dataClusters = (TOTAL_SECTORS - SECTOR_DATA_REGION) >> _sectorsPerClusterShift;
+        bs.jumpInsn[0] = 0xeb; bs.jumpInsn[1] = 0x58; bs.jumpInsn[2] = 0x90;
+        bs.fat32 = {
+            .dos3 = dos3,
+            .sectorsPerFAT = SECTORS_PER_FAT,
+            .extFlags = 0, //FAT is mirrored
+            .fsVersion = 0,
+            .rootDirectoryCluster = FIRST_DATA_CLUSTER,
+            .fsInfoSector = kFAT32FSInfoSector,
+            .backupBootSector = kFAT32BackupBootSector,
+            .reserved = {},
+            .physDriveNumber = 0x80,
+            .flags = 0,
+            .extendedBootSignature = 0x29,
+            .volumeSerialNumber = 0x6d686974,
+            .volumeLabel = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
+            .filesystemType = {'F', 'A', 'T', '3', '2', ' ', ' ', ' '},
+        };
+        memcpy(&bs.fat32.volumeLabel, _volumeLabel, sizeof(bs.fat32.volumeLabel));
         
-    if (offset + size > BYTES_PER_SECTOR) size = BYTES_PER_SECTOR - didRead - offset;
+        fsi.leadSignature = 0x41615252;
+        fsi.structSignature = 0x61417272;
+        fsi.freeClusters = dataClusters - allocatedClusters();
+        fsi.nextFreeCluster = usedClusterEnd();
+        fsi.trailSignature = 0xaa550000;
+    }else{
+        bs.jumpInsn[0] = 0xeb; bs.jumpInsn[1] = 0x3c; bs.jumpInsn[2] = 0x90;
+        bs.dos4 = {
+            .dos3 = dos3,
+            .physDriveNumber = 0,
+            .flags = 0,
+            .extendedBootSignature = 0x29,
+            .volumeSerialNumber = 0x6d686974,
+            .volumeLabel = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
+            .filesystemType = {'F', 'A', 'T', '1', '6', ' ', ' ', ' '},
+        };
+        memcpy(&bs.dos4.volumeLabel, _volumeLabel, sizeof(bs.dos4.volumeLabel));
+    }
+    bs.signature = 0xaa55;
     
-    memset(ptr, 0, size);
-    didRead += size;
+    if (offset + size > RESERVED_SECTORS_CNT*BYTES_PER_SECTOR) size = RESERVED_SECTORS_CNT*BYTES_PER_SECTOR - offset;
+    
+    /*
+        FAT32 keeps a backup of bootsector and FSInfo at sector 6, everything else in the reserved area is zero
+     */
+    while (size) {
+        uint32_t sector = offset >> _bytesPerSectorShift;
+        uint32_t sectorOffset = offset & (BYTES_PER_SECTOR-1);
+        uint32_t chunk = BYTES_PER_SECTOR - sectorOffset;
+        const uint8_t *src = NULL;
+        uint32_t srcSize = 0;
+        uint32_t doCopy = 0;
+        if (chunk > size) chunk = size;
+        
+        if (sector == SECTOR_BOOTSECTOR || (IS_FAT32 && sector == kFAT32BackupBootSector)) {
+            src = (const uint8_t*)&bs; srcSize = sizeof(bs);
+        }else if (IS_FAT32 && (sector == kFAT32FSInfoSector || sector == kFAT32BackupBootSector+kFAT32FSInfoSector)) {
+            src = (const uint8_t*)&fsi; srcSize = sizeof(fsi);
+        }
+        
+        if (sectorOffset < srcSize) {
+            doCopy = srcSize - sectorOffset;
+            if (doCopy > chunk) doCopy = chunk;
+            memcpy(ptr, src+sectorOffset, doCopy);
+        }
+        memset(ptr+doCopy, 0, chunk-doCopy);
+        
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+        didRead += chunk;
+    }
 
 error:
     if (err) {
@@ -204,632 +653,2445 @@ error:
     return didRead;
 }
 
-int32_t EmuFATFSBase::readRootDirectory(uint32_t offset, void *buf, uint32_t size){
-  int err = 0;
-  int32_t didRead = 0;
-  uint8_t *ptr = (uint8_t*)buf;
-  FAT_DirectoryTableFileEntry_t dfe = {};
-  
-  uint32_t processedEntries = 1;
-  
-#define DTINDEX (offset / sizeof(dfe))
-#define MOVEOFFSET do {ptr += sizeof(FAT_DirectoryTableFileEntry_t); size -= sizeof(FAT_DirectoryTableFileEntry_t); didRead+=sizeof(FAT_DirectoryTableFileEntry_t); offset +=sizeof(FAT_DirectoryTableFileEntry_t);} while(0)
-  
-  cretassure((offset % sizeof(dfe)) == 0, "Partial entry reads are not handled");
-  
-  if (DTINDEX == 0) {
-      if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-      FAT_DirectoryTableLFNEntry_t *vle = (FAT_DirectoryTableLFNEntry_t *)ptr;
-      snprintf((char*)vle, 13, "%s             ",_volumeLabel);
-      vle->attributes = FILEENTRY_ATTR_VOLUME_LABEL;
-      MOVEOFFSET;
-  }
-  
-  for (int i=0; i<_usedFiles; i++) {
-      const FileEntry *cfe = &_fileStorage[i];
-      uint8_t neededExtraEntries = cfe->filenameLenNoSuffix;
-      if (cfe->filename[cfe->filenameLenNoSuffix+1] != ' '){
-        neededExtraEntries+=2;
-        for (int j=1; j<3; j++) {
-            if (cfe->filename[cfe->filenameLenNoSuffix+1+j] == ' ') break;
-            neededExtraEntries++;
+int32_t EmuFATFSBase::readExFATBootRegion(uint32_t offset, void *buf, uint32_t size){
+    int32_t didRead = 0;
+    uint8_t *ptr = (uint8_t*)buf;
+    exFAT_Bootsector_t bs = {};
+    const uint8_t extendedSignature[4] = {0x00, 0x00, 0x55, 0xaa};
+    uint32_t dataClusters = (TOTAL_SECTORS - SECTOR_DATA_REGION) >> _sectorsPerClusterShift;
+    uint32_t usedClusters = _bitmapCluster + _bitmapClusters - FIRST_DATA_CLUSTER;
+    uint32_t checksum = 0;
+    
+    bs.jumpInsn[0] = 0xeb; bs.jumpInsn[1] = 0x76; bs.jumpInsn[2] = 0x90;
+    memcpy(bs.filesystemName, "EXFAT   ", sizeof(bs.filesystemName));
+    bs.partitionOffset = 0;
+    bs.volumeLength = TOTAL_SECTORS;
+    bs.fatOffset = RESERVED_SECTORS_CNT;
+    bs.fatLength = SECTORS_PER_FAT;
+    bs.clusterHeapOffset = SECTOR_DATA_REGION;
+    bs.clusterCount = dataClusters;
+    bs.firstClusterOfRootDirectory = FIRST_DATA_CLUSTER;
+    bs.volumeSerialNumber = 0x6d686974;
+    bs.filesystemRevision = 0x0100;
+    bs.volumeFlags = 0;
+    bs.bytesPerSectorShift = _bytesPerSectorShift;
+    bs.sectorsPerClusterShift = _sectorsPerClusterShift;
+    bs.numberOfFATs = 1;
+    bs.driveSelect = 0x80;
+    bs.percentInUse = static_cast<uint8_t>((uint64_t)usedClusters * 100 / dataClusters);
+    bs.signature = 0xaa55;
+    
+    /*
+        Sectors 0-10 of the boot region are checksummed into sector 11 (skipping volumeFlags and percentInUse).
+        Apart from the bootsector only the extended boot sectors 1-8 carry a signature.
+     */
+    for (uint32_t i=0; i<BYTES_PER_SECTOR; i++) {
+        if (i == offsetof(exFAT_Bootsector_t, volumeFlags) || i == offsetof(exFAT_Bootsector_t, volumeFlags)+1 || i == offsetof(exFAT_Bootsector_t, percentInUse)) continue;
+        checksum = exfat_checksum32(checksum, i < sizeof(bs) ? ((const uint8_t*)&bs)[i] : 0);
+    }
+    for (uint32_t s=1; s<11; s++) {
+        for (uint32_t i=0; i<BYTES_PER_SECTOR; i++) {
+            uint32_t sigOffset = i - (BYTES_PER_SECTOR-sizeof(extendedSignature));
+            checksum = exfat_checksum32(checksum, (s <= 8 && sigOffset < sizeof(extendedSignature)) ? extendedSignature[sigOffset] : 0);
         }
+    }
+    
+    if (offset + size > RESERVED_SECTORS_CNT*BYTES_PER_SECTOR) size = RESERVED_SECTORS_CNT*BYTES_PER_SECTOR - offset;
+    
+    //main boot region followed by the identical backup boot region
+    while (size) {
+        uint32_t sector = (offset >> _bytesPerSectorShift) % kExFATBootRegionSectors;
+        uint32_t sectorOffset = offset & (BYTES_PER_SECTOR-1);
+        uint32_t chunk = BYTES_PER_SECTOR - sectorOffset;
+        if (chunk > size) chunk = size;
+        
+        memset(ptr, 0, chunk);
+        for (uint32_t i=0; i<chunk; i++) {
+            uint32_t pos = sectorOffset + i;
+            if (sector == 0) {
+                if (pos < sizeof(bs)) ptr[i] = ((const uint8_t*)&bs)[pos];
+            }else if (sector <= 8) {
+                uint32_t sigOffset = pos - (BYTES_PER_SECTOR-sizeof(extendedSignature));
+                if (sigOffset < sizeof(extendedSignature)) ptr[i] = extendedSignature[sigOffset];
+            }else if (sector == 11) {
+                ptr[i] = (uint8_t)(checksum >> (8*(pos & 3)));
+            }
+        }
+        
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+        didRead += chunk;
+    }
+    
+    return didRead;
+}
+
+void EmuFATFSBase::buildShortName(uint16_t fileIdx, char shortName[11]){
+  const FileEntry *cfe = &_fileStorage[fileIdx];
+
+  snprintf(shortName, 9, "%s        ",cfe->filename);
+  if (cfe->filenameLenNoSuffix > 8) {
+      snprintf(&shortName[6], 4, "\x7e%d",fileIdx+1);
+  }
+  for (int k=0; k<8; k++) {
+      shortName[k] = toupper(shortName[k]);
+      if (shortName[k] == '.'){
+          shortName[k] = '_';
       }
-      if (neededExtraEntries % LFN_ENTRY_MAX_NAME_LEN) neededExtraEntries += LFN_ENTRY_MAX_NAME_LEN;
-      neededExtraEntries /= LFN_ENTRY_MAX_NAME_LEN;
-      
-      //first construct main entry
-      dfe = {
-          /*
-              The following 3 members are not filled here, but in the code down below
-            */
-          .shortFilename = {},
-          .filenameExt = {},
-          .fileAttributes = {},
-          /*
-              Actual data
-            */
-          .reserved = 0,
-          .createTime_ms = 0,
-          .createTime = 0,
-          .createDate = 0,
-          .accessedDate = 0,
-          .clusterNumber_High = static_cast<uint16_t>(cfe->startCluster>>16),
-          .modifiedTime = 0,
-          .modifiedDate = 0,
-          .clusterLocation = static_cast<uint16_t>(cfe->startCluster),
-          .fileSize = cfe->fileSize,
-      };
-      snprintf(dfe.shortFilename, 9, "%s        ",cfe->filename);
-      if (cfe->filenameLenNoSuffix > 8) {
-          snprintf(&dfe.shortFilename[6], 4, "\x7e%d",i+1);
+  }
+  for (int z = 0; z < 3; z++){
+    shortName[8+z] = toupper(cfe->filename[cfe->filenameLenNoSuffix+1+z]);
+  }
+}
+
+uint8_t EmuFATFSBase::buildFixedEntries(uint16_t dirIdx, FAT_DirectoryTableEntry_t *set){
+  FAT_DirectoryTableEntry_t *e = set;
+
+  if (dirIdx != kNoFile) {
+      //exFAT subdirectories have no "." and ".." entries
+      if (IS_EXFAT) return 0;
+      const FileEntry *dir = &_fileStorage[dirIdx];
+      uint32_t parentCluster = dir->parent == kNoFile ? 0 : _fileStorage[dir->parent].startCluster;
+
+      memset(e, 0, 2*sizeof(*e));
+      for (int i=0; i<2; i++) {
+          FAT_DirectoryTableFileEntry_t *dfe = &(e++)->dfe;
+          uint32_t cluster = i ? parentCluster : dir->startCluster;
+          memset(dfe->shortFilename, ' ', sizeof(dfe->shortFilename) + sizeof(dfe->filenameExt));
+          memset(dfe->shortFilename, '.', i+1);
+          dfe->fileAttributes = FILEENTRY_ATTR_SUBDIR;
+          dfe->clusterNumber_High = static_cast<uint16_t>(cluster>>16);
+          dfe->clusterLocation = static_cast<uint16_t>(cluster);
       }
-      for (int k=0; k<sizeof(dfe.shortFilename); k++) {
-          dfe.shortFilename[k] = toupper(dfe.shortFilename[k]);
-          if (dfe.shortFilename[k] == '.'){
-              dfe.shortFilename[k] = '_';
+      return 2;
+  }
+
+  memset(e, 0, ROOT_DIRECTORY_FIXED_ENTRIES*sizeof(*e));
+  if (IS_EXFAT) {
+      uint32_t dataClusters = (TOTAL_SECTORS - SECTOR_DATA_REGION) >> _sectorsPerClusterShift;
+      {
+          exFAT_VolumeLabelEntry_t *vle = &(e++)->exLabel;
+          vle->entryType = EXFAT_ENTRY_VOLUME_LABEL;
+          for (int i=0; i<sizeof(vle->volumeLabel)/sizeof(*vle->volumeLabel); i++) {
+              vle->volumeLabel[i] = _volumeLabel[i];
+              if (_volumeLabel[i] != ' ') vle->characterCount = i+1;
           }
       }
-      for (int z = 0; z < 3; z++){
-        dfe.filenameExt[z] = toupper(cfe->filename[cfe->filenameLenNoSuffix+1+z]);
+      {
+          exFAT_AllocationEntry_t *bme = &(e++)->exAlloc;
+          bme->entryType = EXFAT_ENTRY_BITMAP;
+          bme->firstCluster = _bitmapCluster;
+          bme->dataLength = (dataClusters+7)/8;
+      }
+      {
+          exFAT_AllocationEntry_t *uce = &(e++)->exAlloc;
+          uce->entryType = EXFAT_ENTRY_UPCASE;
+          for (int i=0; i<sizeof(gExFATUpcaseTable); i++) {
+              uce->tableChecksum = exfat_checksum32(uce->tableChecksum, ((const uint8_t*)gExFATUpcaseTable)[i]);
+          }
+          uce->firstCluster = UPCASE_CLUSTER;
+          uce->dataLength = sizeof(gExFATUpcaseTable);
       }
+  }else{
+      FAT_DirectoryTableLFNEntry_t *vle = &(e++)->lfn;
+      snprintf((char*)vle, 13, "%s             ",_volumeLabel);
+      vle->attributes = FILEENTRY_ATTR_VOLUME_LABEL;
+  }
+  return ROOT_DIRECTORY_FIXED_ENTRIES;
+}
 
-      uint8_t csum = lfn_checksum(dfe.shortFilename);
-      dfe.fileAttributes = FILEENTRY_ATTR_SYSTEM | (cfe->f_write == NULL ? FILEENTRY_ATTR_READONLY : 0);
+uint8_t EmuFATFSBase::buildExFATEntrySet(uint16_t fileIdx, FAT_DirectoryTableEntry_t *set){
+  const FileEntry *cfe = &_fileStorage[fileIdx];
+  uint16_t nameLen = longFilenameLength(cfe);
+  uint8_t setEntries = directoryEntriesForFile(cfe);
+  exFAT_FileEntry_t *fe = &set[0].exFile;
+  exFAT_StreamExtensionEntry_t *se = &set[1].exStream;
+  
+  memset(set, 0, setEntries*sizeof(*set));
+  fe->entryType = EXFAT_ENTRY_FILE;
+  fe->secondaryCount = setEntries-1;
+  fe->fileAttributes = cfe->isDirectory ? FILEENTRY_ATTR_SUBDIR : FILEENTRY_ATTR_SYSTEM | (isWritable(cfe) ? 0 : FILEENTRY_ATTR_READONLY);
+  fe->createTimestamp = fe->modifiedTimestamp = fe->accessedTimestamp = 0x00210000; //1980-01-01
+  
+  se->entryType = EXFAT_ENTRY_STREAM;
+  se->flags = EXFAT_FLAG_ALLOCATION_POSSIBLE;
+  se->nameLength = static_cast<uint8_t>(nameLen);
+  if (cfe->isDirectory) {
+      //directories always span whole clusters
+      se->flags |= EXFAT_FLAG_NO_FAT_CHAIN;
+      se->firstCluster = cfe->startCluster;
+      se->validDataLength = se->dataLength = (uint64_t)cfe->clusterCount << CLUSTER_SHIFT;
+  }else if (cfe->fileSize) {
+      //files are always contiguous, so the FAT doesn't need to describe them
+      se->flags |= EXFAT_FLAG_NO_FAT_CHAIN;
+      se->firstCluster = cfe->startCluster;
+      se->validDataLength = se->dataLength = cfe->fileSize;
+  }
+  
+  for (uint16_t j=0; j<nameLen; j++) {
+      exFAT_FileNameEntry_t *ne = &set[2 + j/EXFAT_FILENAME_ENTRY_MAX_NAME_LEN].exName;
+      char c = '.';
+      if (j < cfe->filenameLenNoSuffix) c = cfe->filename[j];
+      else if (j > cfe->filenameLenNoSuffix) c = cfe->filename[j];
       
-      if (DTINDEX == processedEntries++){
-          //first entry marking end of name
-          FAT_DirectoryTableLFNEntry_t *lfn = (FAT_DirectoryTableLFNEntry_t*)ptr;
-          if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-          
-          memset(lfn, 0xFF, sizeof(*lfn));
-          lfn->sequenceNumber = neededExtraEntries | LFN_ENTRY_LAST;
-          lfn->attributes = FILEENTRY_ATTR_LFN_ENTRY;
-          lfn->type = 0;
-          lfn->checksum = csum;
-          lfn->zero = 0;
-          
-          const char *fnameend = cfe->filename + (neededExtraEntries-1)*LFN_ENTRY_MAX_NAME_LEN;
-          ssize_t fnameendLen = 0;
-          if (fnameend - cfe->filename > cfe->filenameLenNoSuffix) {
-              fnameendLen = (ssize_t)cfe->filenameLenNoSuffix - (fnameend - cfe->filename);
-              fnameend = NULL;
-          }else{
-              fnameendLen = strlen(fnameend);
-          }
+      ne->entryType = EXFAT_ENTRY_FILENAME;
+      ne->name[j % EXFAT_FILENAME_ENTRY_MAX_NAME_LEN] = (uint8_t)c;
+      c = toupper(c); //matches the up-case table
+      se->nameHash = exfat_checksum16(se->nameHash, (uint8_t)c);
+      se->nameHash = exfat_checksum16(se->nameHash, 0);
+  }
+  
+  for (uint32_t j=0; j<setEntries*sizeof(*set); j++) {
+      if (j == offsetof(exFAT_FileEntry_t, setChecksum) || j == offsetof(exFAT_FileEntry_t, setChecksum)+1) continue;
+      fe->setChecksum = exfat_checksum16(fe->setChecksum, ((const uint8_t*)set)[j]);
+  }
+  return setEntries;
+}
 
-          for (int j = 0; j<LFN_ENTRY_MAX_NAME_LEN && j <=fnameendLen+1+3; j++) {
-              char c = '\0';
-              if (fnameend) {
-                  c = *fnameend++;
-                  if (!c){
-                      if (cfe->filename[cfe->filenameLenNoSuffix+1] == ' '){
-                        c = '\0';
-                      }else{
-                        c = '.';
-                      }
-                      fnameend = NULL;
-                  }
-              }else{
-                  int suffixIdx = j - (int)(fnameendLen+1);
-                  if (suffixIdx < 3) {
-                      c = cfe->filename[cfe->filenameLenNoSuffix+1 + suffixIdx];
+uint8_t EmuFATFSBase::buildEntrySet(uint16_t fileIdx, FAT_DirectoryTableEntry_t *set){
+  if (IS_EXFAT) return buildExFATEntrySet(fileIdx, set);
+  const FileEntry *cfe = &_fileStorage[fileIdx];
+  FAT_DirectoryTableEntry_t *e = set;
+  FAT_DirectoryTableFileEntry_t dfe = {};
+  char shortName[11] = {};
+  uint8_t neededExtraEntries = lfnEntriesForFile(cfe);
+  
+  //first construct main entry
+  dfe = {
+      /*
+          The following 3 members are not filled here, but in the code down below
+        */
+      .shortFilename = {},
+      .filenameExt = {},
+      .fileAttributes = {},
+      /*
+          Actual data
+        */
+      .reserved = 0,
+      .createTime_ms = 0,
+      .createTime = 0,
+      .createDate = 0,
+      .accessedDate = 0,
+      .clusterNumber_High = static_cast<uint16_t>(cfe->startCluster>>16),
+      .modifiedTime = 0,
+      .modifiedDate = 0,
+      .clusterLocation = static_cast<uint16_t>(cfe->startCluster),
+      .fileSize = cfe->isDirectory ? 0 : static_cast<uint32_t>(cfe->fileSize),
+  };
+  buildShortName(fileIdx, shortName);
+  memcpy(dfe.shortFilename, shortName, sizeof(dfe.shortFilename));
+  memcpy(dfe.filenameExt, &shortName[sizeof(dfe.shortFilename)], sizeof(dfe.filenameExt));
+
+  uint8_t csum = lfn_checksum(shortName);
+  dfe.fileAttributes = cfe->isDirectory ? FILEENTRY_ATTR_SUBDIR : FILEENTRY_ATTR_SYSTEM | (isWritable(cfe) ? 0 : FILEENTRY_ATTR_READONLY);
+  
+  {
+      //first entry marking end of name
+      FAT_DirectoryTableLFNEntry_t *lfn = &(e++)->lfn;
+      
+      memset(lfn, 0xFF, sizeof(*lfn));
+      lfn->sequenceNumber = neededExtraEntries | LFN_ENTRY_LAST;
+      lfn->attributes = FILEENTRY_ATTR_LFN_ENTRY;
+      lfn->type = 0;
+      lfn->checksum = csum;
+      lfn->zero = 0;
+      
+      const char *fnameend = cfe->filename + (neededExtraEntries-1)*LFN_ENTRY_MAX_NAME_LEN;
+      ssize_t fnameendLen = 0;
+      if (fnameend - cfe->filename > cfe->filenameLenNoSuffix) {
+          fnameendLen = (ssize_t)cfe->filenameLenNoSuffix - (fnameend - cfe->filename);
+          fnameend = NULL;
+      }else{
+          fnameendLen = strlen(fnameend);
+      }
+
+      for (int j = 0; j<LFN_ENTRY_MAX_NAME_LEN && j <=fnameendLen+1+3; j++) {
+          char c = '\0';
+          if (fnameend) {
+              c = *fnameend++;
+              if (!c){
+                  if (cfe->filename[cfe->filenameLenNoSuffix+1] == ' '){
+                    c = '\0';
+                  }else{
+                    c = '.';
                   }
-                  if (c == ' ') c = '\0';
+                  fnameend = NULL;
               }
-              
-              if (j < 5) {
-                  lfn->name1[j] = c;
-              } else if (j < 5+6) {
-                  lfn->name2[j-5] = c;
-              } else {
-                  lfn->name3[j-(5+6)] = c;
+          }else{
+              int suffixIdx = j - (int)(fnameendLen+1);
+              if (suffixIdx < 3) {
+                  c = cfe->filename[cfe->filenameLenNoSuffix+1 + suffixIdx];
               }
-              if (c == '\0') break;
+              if (c == ' ') c = '\0';
           }
-          MOVEOFFSET;
+          
+          if (j < 5) {
+              lfn->name1[j] = c;
+          } else if (j < 5+6) {
+              lfn->name2[j-5] = c;
+          } else {
+              lfn->name3[j-(5+6)] = c;
+          }
+          if (c == '\0') break;
       }
+  }
+  
+  for (int z=neededExtraEntries-2; z>=0; z--) {
+      FAT_DirectoryTableLFNEntry_t *lfn = &(e++)->lfn;
       
-      for (int z=neededExtraEntries-2; z>=0; z--) {
-          if (DTINDEX == processedEntries++){
-              FAT_DirectoryTableLFNEntry_t *lfn = (FAT_DirectoryTableLFNEntry_t*)ptr;
-              if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-              
-              memset(lfn, 0xFF, sizeof(*lfn));
-              lfn->sequenceNumber = z+1;
-              lfn->attributes = FILEENTRY_ATTR_LFN_ENTRY;
-              lfn->type = 0;
-              lfn->checksum = csum;
-              lfn->zero = 0;
-              
-              for (int j = 0; j<LFN_ENTRY_MAX_NAME_LEN; j++) {
-                  char c = cfe->filename[j+z*LFN_ENTRY_MAX_NAME_LEN];
-                  
-                  if (j+z*LFN_ENTRY_MAX_NAME_LEN == cfe->filenameLenNoSuffix){
-                      c = '.';
-                  }
-                  
-                  if (j < 5) {
-                      lfn->name1[j] = c;
-                  } else if (j < 5+6) {
-                      lfn->name2[j-5] = c;
-                  } else {
-                      lfn->name3[j-(5+6)] = c;
-                  }
-              }
-              MOVEOFFSET;
+      memset(lfn, 0xFF, sizeof(*lfn));
+      lfn->sequenceNumber = z+1;
+      lfn->attributes = FILEENTRY_ATTR_LFN_ENTRY;
+      lfn->type = 0;
+      lfn->checksum = csum;
+      lfn->zero = 0;
+      
+      for (int j = 0; j<LFN_ENTRY_MAX_NAME_LEN; j++) {
+          char c = cfe->filename[j+z*LFN_ENTRY_MAX_NAME_LEN];
+          
+          if (j+z*LFN_ENTRY_MAX_NAME_LEN == cfe->filenameLenNoSuffix){
+              c = '.';
+          }
+          
+          if (j < 5) {
+              lfn->name1[j] = c;
+          } else if (j < 5+6) {
+              lfn->name2[j-5] = c;
+          } else {
+              lfn->name3[j-(5+6)] = c;
           }
       }
+  }
 
-      if (DTINDEX == processedEntries++){
-          if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-          memcpy(ptr, &dfe, sizeof(dfe));
-          MOVEOFFSET;
+  (e++)->dfe = dfe;
+  return static_cast<uint8_t>(e - set);
+}
+
+uint32_t EmuFATFSBase::generateDirectory(uint16_t dirIdx, uint32_t offset, void *buf, uint32_t size){
+  FAT_DirectoryTableEntry_t set[kMaxEntriesPerSet];
+  uint8_t *ptr = (uint8_t*)buf;
+  uint32_t end = offset + size;
+  uint32_t pos = 0;
+  uint16_t i = dirIdx == kNoFile ? _rootFirstChild : _fileStorage[dirIdx].firstChild;
+
+  /*
+      Only the entry sets intersecting [offset, end) are built, the ones in front of the window are skipped by their size.
+      Cost is bounded by the size of this directory, not by the number of files on the volume.
+   */
+  auto emit = [&](uint8_t setEntries){
+      uint32_t setEnd = pos + setEntries*sizeof(*set);
+      if (setEnd > offset && pos < end) {
+          uint32_t from = pos > offset ? pos : offset;
+          uint32_t to = setEnd < end ? setEnd : end;
+          memcpy(ptr + (from - offset), ((uint8_t*)set) + (from - pos), to - from);
+      }
+      pos = setEnd;
+  };
+
+  emit(buildFixedEntries(dirIdx, set));
+  for (; i != kNoFile && pos < end; i = _fileStorage[i].nextSibling) {
+      uint32_t setSize = directoryEntriesForFile(&_fileStorage[i])*sizeof(*set);
+      if (pos + setSize <= offset) {
+          pos += setSize;
+          continue;
       }
+      emit(buildEntrySet(i, set));
   }
+  
+  if (pos <= offset) return 0;
+  return (pos < end ? pos : end) - offset;
+}
 
-  if (offset + size > SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR) size = SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR - didRead - offset;
-  memset(ptr, 0, size); didRead += size;
+void EmuFATFSBase::buildRootDirectoryCache(){
+  uint16_t generated = _rootDirectoryEntries < _rootShadowSlots ? _rootDirectoryEntries : _rootShadowSlots;
+
+  /*
+      Slots where the host still has the previous image follow the new one (0 is the empty slot until then),
+      slots it wrote itself keep their checksum, so writing them back again stays a no-op
+   */
+  for (uint16_t i=0; i<_rootShadowGenerated; i++) {
+      if (_rootShadow[i] == slot_checksum(&_rootDirectoryCache[i])) _rootShadow[i] = 0;
+  }
+  generateDirectory(kNoFile, 0, _rootDirectoryCache, _rootDirectoryEntries * sizeof(FAT_DirectoryTableEntry_t));
+  _rootDirectoryCacheValid = true;
+  for (uint16_t i=0; i<generated; i++) {
+      if (!_rootShadow[i]) _rootShadow[i] = slot_checksum(&_rootDirectoryCache[i]);
+  }
+  _rootShadowGenerated = generated;
+}
+
+void EmuFATFSBase::invalidateDirectoryCaches(){
+  _rootDirectoryCacheValid = false;
+  _directoryCacheOwner = kNoFile;
+}
+
+void EmuFATFSBase::invalidateDirectoryCache(uint16_t dirIdx){
+  if (dirIdx == kNoFile) _rootDirectoryCacheValid = false;
+  else if (_directoryCacheOwner == dirIdx) _directoryCacheOwner = kNoFile;
+}
+
+int32_t EmuFATFSBase::readRootDirectory(uint32_t offset, void *buf, uint32_t size){
+  int32_t didRead = 0;
+  uint8_t *ptr = (uint8_t*)buf;
+  uint32_t imageSize = 0;
+  uint64_t statsStart = statsTicks();
+
+  if (!_rootDirectoryCacheValid) buildRootDirectoryCache();
+  imageSize = _rootDirectoryEntries * sizeof(FAT_DirectoryTableEntry_t);
   
-error:
-  if (err) {
-      return -err;
+  if (offset < imageSize) {
+      uint32_t doCopy = imageSize - offset;
+      if (doCopy > size) doCopy = size;
+      memcpy(ptr, ((uint8_t*)_rootDirectoryCache)+offset, doCopy);
+      ptr += doCopy;
+      size -= doCopy;
+      offset += doCopy;
+      didRead += doCopy;
   }
+
+  if (offset + size > ROOT_DIRECTORY_BYTES) size = static_cast<uint32_t>(ROOT_DIRECTORY_BYTES - offset);
+  memset(ptr, 0, size); didRead += size;
+  
+  STATS_LATENCY(rootDirectory, statsStart);
   return didRead;
-#undef MOVEOFFSET
-#undef DTINDEX
 }
 
-int32_t EmuFATFSBase::catchRootDirectoryAccess(uint32_t offset, const void *buf, uint32_t size){
-    int err = 0;
-    int32_t didWrite = 0;
-    const uint8_t *ptr = (const uint8_t*)buf;
-    FAT_DirectoryTableFileEntry_t dfe = {};
-    uint32_t processedEntries = 1;
-    
-#define DTINDEX (offset / sizeof(dfe))
-#define MOVEOFFSET do {ptr += sizeof(FAT_DirectoryTableFileEntry_t); size -= sizeof(FAT_DirectoryTableFileEntry_t); didWrite+=sizeof(FAT_DirectoryTableFileEntry_t); offset +=sizeof(FAT_DirectoryTableFileEntry_t);} while(0)
+int32_t EmuFATFSBase::readDirectory(uint16_t dirIdx, uint32_t offset, void *buf, uint32_t size){
+  uint8_t *ptr = (uint8_t*)buf;
+  uint32_t imageSize = static_cast<uint32_t>(_fileStorage[dirIdx].fileSize);
+  uint32_t didCopy = 0;
+
+  if (offset < imageSize) {
+      uint32_t doCopy = imageSize - offset;
+      if (doCopy > size) doCopy = size;
+      if (!_sharedReaders && _directoryCacheOwner != dirIdx && imageSize <= _directoryCacheSize*sizeof(FAT_DirectoryTableEntry_t)) {
+          generateDirectory(dirIdx, 0, _directoryCache, imageSize);
+          _directoryCacheOwner = dirIdx;
+      }
+      if (_directoryCacheOwner == dirIdx) {
+          memcpy(ptr, ((uint8_t*)_directoryCache)+offset, doCopy);
+          didCopy = doCopy;
+      }else{
+          didCopy = generateDirectory(dirIdx, offset, ptr, doCopy);
+      }
+  }
+  memset(ptr+didCopy, 0, size-didCopy);
+  return size;
+}
+
+int32_t EmuFATFSBase::readAllocationBitmap(uint32_t offset, void *buf, uint32_t size){
+    uint8_t *ptr = (uint8_t*)buf;
+    uint64_t firstCluster = FIRST_DATA_CLUSTER + (uint64_t)offset*8;
+    uint64_t endCluster = firstCluster + (uint64_t)size*8;
+    uint16_t i = 0;
     
-    cretassure((offset % sizeof(dfe)) == 0, "Partial entry reads are not handled");
+    /*
+        Bit n marks cluster n+2 as used, set the bits of every extent intersecting the window
+     */
+    auto setextent = [&](uint64_t startCluster, uint64_t clusterCount){
+        uint64_t start = startCluster > firstCluster ? startCluster : firstCluster;
+        uint64_t end = startCluster + clusterCount < endCluster ? startCluster + clusterCount : endCluster;
+        if (start < end) bitmap_set_range(ptr, static_cast<uint32_t>(start - firstCluster), static_cast<uint32_t>(end - start));
+    };
     
-    if (DTINDEX == 0) {
-        if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-        MOVEOFFSET;
+    memset(ptr, 0, size);
+    setextent(FIRST_DATA_CLUSTER, _rootDirectoryClusters);
+    setextent(UPCASE_CLUSTER, 1);
+    i = clusterIndexUpperBound(static_cast<uint32_t>(firstCluster));
+    if (i) i--;
+    for (; i<_clusterIndexCnt && _fileStorage[_clusterIndex[i]].startCluster < endCluster; i++) {
+        const FileEntry *cur = &_fileStorage[_clusterIndex[i]];
+        setextent(cur->startCluster, cur->clusterCount);
     }
+    setextent(_bitmapCluster, _bitmapClusters);
     
-    for (int i=0; i<_usedFiles; i++) {
-        FileEntry *cfe = &_fileStorage[i];
-        uint8_t neededExtraEntries = cfe->filenameLenNoSuffix;
-        if (cfe->filename[cfe->filenameLenNoSuffix+1] != ' '){
-          neededExtraEntries+=2;
-          for (int j=1; j<3; j++) {
-              if (cfe->filename[cfe->filenameLenNoSuffix+1+j] == ' ') break;
-              neededExtraEntries++;
-          }
-        }
-        if (neededExtraEntries % LFN_ENTRY_MAX_NAME_LEN) neededExtraEntries += LFN_ENTRY_MAX_NAME_LEN;
-        neededExtraEntries /= LFN_ENTRY_MAX_NAME_LEN;
-        
-        if (DTINDEX == processedEntries++){
-            MOVEOFFSET;
+    return size;
+}
+
+int32_t EmuFATFSBase::readUpcaseTable(uint32_t offset, void *buf, uint32_t size){
+    uint8_t *ptr = (uint8_t*)buf;
+    uint32_t didCopy = 0;
+    
+    if (offset < sizeof(gExFATUpcaseTable)) {
+        didCopy = sizeof(gExFATUpcaseTable) - offset;
+        if (didCopy > size) didCopy = size;
+        memcpy(ptr, ((const uint8_t*)gExFATUpcaseTable)+offset, didCopy);
+    }
+    memset(ptr+didCopy, 0, size-didCopy);
+    return size;
+}
+
+void EmuFATFSBase::indexShortName(uint16_t fileIdx){
+    char shortName[11] = {};
+    uint16_t *bucket = NULL;
+
+    buildShortName(fileIdx, shortName);
+    bucket = &_nameBuckets[short_name_hash(shortName) & (_nameBucketCount-1)];
+    _fileStorage[fileIdx].nextByName = *bucket;
+    *bucket = fileIdx;
+}
+
+bool EmuFATFSBase::longFilenameMatches(const FileEntry *cfe, const char *name){
+    uint16_t len = longFilenameLength(cfe);
+    for (uint16_t i=0; i<len; i++) {
+        char c = i == cfe->filenameLenNoSuffix ? '.' : cfe->filename[i];
+        if (toupper(c) != toupper(name[i])) return false;
+    }
+    return name[len] == '\0';
+}
+
+EmuFATFSBase::FileEntry *EmuFATFSBase::findRootEntry(const FAT_DirectoryTableFileEntry_t *dfe, const char *longName){
+    FileEntry *found = NULL;
+    char hostName[11] = {};
+    uint32_t clusterLocation = dfe->clusterLocation | (IS_FAT32 ? (uint32_t)dfe->clusterNumber_High << 16 : 0);
+    bool deleted = (uint8_t)dfe->shortFilename[0] == 0xe5;
+
+    memcpy(hostName, dfe->shortFilename, sizeof(dfe->shortFilename));
+    memcpy(&hostName[sizeof(dfe->shortFilename)], dfe->filenameExt, sizeof(dfe->filenameExt));
+    for (uint16_t i = _nameBuckets[short_name_hash(hostName) & (_nameBucketCount-1)]; i != kNoFile; i = _fileStorage[i].nextByName) {
+        FileEntry *cfe = &_fileStorage[i];
+        char shortName[11] = {};
+        buildShortName(i, shortName);
+        if (memcmp(&shortName[1], &hostName[1], sizeof(shortName)-1) || (!deleted && shortName[0] != hostName[0])) continue;
+        //short names aren't unique ("~1" is file 1 and 10), the long name and the start cluster tell them apart
+        if (longName && !longFilenameMatches(cfe, longName)) continue;
+        if (cfe->startCluster == clusterLocation) return cfe;
+        if (!found) found = cfe;
+    }
+    return found;
+}
+
+int32_t EmuFATFSBase::updateRootEntry(FileEntry *cfe, const FAT_DirectoryTableFileEntry_t *dfe, bool *clustersChanged){
+    bool fileWasDeleted = ((uint8_t)dfe->shortFilename[0] == 0xe5);
+    int32_t notice = 0;
+
+    if (cfe->isDirectory){
+      //directories are generated, host changes to them are dropped
+    }else if (fileWasDeleted || (dfe->fileSize == 0 && cfe->fileSize != 0)){
+      if (cfe->startCluster) *clustersChanged = true;
+      cfe->startCluster = 0;
+      notice = fileWrite(cfe, -1, NULL, 0);
+    }else if (cfe->isDynamicFile){
+      uint32_t newClusterCount = clustersForSize(dfe->fileSize);
+      uint32_t newStartCluster = dfe->clusterLocation | (IS_FAT32 ? (uint32_t)dfe->clusterNumber_High << 16 : 0);
+
+      if (cfe->startCluster != newStartCluster) *clustersChanged = true;
+      cfe->startCluster = newStartCluster;
+      //chained files (clusterCount 0) are described by the host's FAT, so they may change size freely
+      if ((!cfe->clusterCount || cfe->clusterCount == newClusterCount) && cfe->fileSize != dfe->fileSize){
+        cfe->fileSize = dfe->fileSize;
+        invalidateDirectoryCaches();
+      }
+    }
+    return notice < 0 ? notice : 0;
+}
+
+int32_t EmuFATFSBase::catchRootDirectoryAccess(uint32_t offset, const void *buf, uint32_t size){
+    int err = 0;
+    int32_t didWrite = 0;
+    const uint8_t *ptr = (const uint8_t*)buf;
+    bool clustersChanged = false;
+    int32_t failed = 0;
+    int remainingSequences = 0;
+    char curFilenameBuf[0x101] = {};
+    char *curFilename = &curFilenameBuf[0x100];
+    uint8_t curChecksum = 0;
+
+#define MOVEOFFSET do {ptr += sizeof(FAT_DirectoryTableEntry_t); size -= sizeof(FAT_DirectoryTableEntry_t); didWrite+=sizeof(FAT_DirectoryTableEntry_t); offset +=sizeof(FAT_DirectoryTableEntry_t);} while(0)
+#define RESETLFN do {remainingSequences = 0; curFilename = &curFilenameBuf[0x100]; curChecksum = 0;} while(0)
+
+    cretassure((offset % sizeof(FAT_DirectoryTableEntry_t)) == 0, "Partial entry reads are not handled");
+    //takes the shadow of the generated slots
+    if (!_rootDirectoryCacheValid) buildRootDirectoryCache();
+
+    /*
+        Only slots which differ from the shadow are looked at, so rewriting unchanged sectors is a checksum per slot.
+        Entries are matched to files by name (renames by their start cluster), not by their position,
+        so the host may reorder or compact the directory.
+     */
+    while (size >= sizeof(FAT_DirectoryTableEntry_t)) {
+        const FAT_DirectoryTableEntry_t *e = (const FAT_DirectoryTableEntry_t*)ptr;
+        uint32_t slot = offset / sizeof(*e);
+        uint32_t slotsLeft = size / sizeof(*e);
+        uint32_t unchanged = 0;
+        uint32_t csum = 0;
+
+        if (slot < _rootShadowSlots) {
+            if (slotsLeft > _rootShadowSlots - slot) slotsLeft = _rootShadowSlots - slot;
+            while (unchanged < slotsLeft && _rootShadow[slot+unchanged] == (csum = slot_checksum(&e[unchanged]))) unchanged++;
+            if (unchanged) {
+                uint32_t skip = unchanged * sizeof(*e);
+                ptr += skip; size -= skip; didWrite += skip; offset += skip;
+                RESETLFN;
+                continue;
+            }
+            _rootShadow[slot] = csum;
+        }
+        MOVEOFFSET;
+
+        if (e->lfn.attributes == FILEENTRY_ATTR_LFN_ENTRY) {
+            if (remainingSequences == 0) {
+                RESETLFN;
+                if ((e->lfn.sequenceNumber & 0xF0) == LFN_ENTRY_LAST) {
+                    remainingSequences = e->lfn.sequenceNumber & 0x3F;
+                    curChecksum = e->lfn.checksum;
+                }
+            }
+            if ((e->lfn.sequenceNumber & 0x3F) != remainingSequences-- || e->lfn.checksum != curChecksum) {
+                RESETLFN;
+                continue;
+            }
+            int curPartLen = 0;
+            for (int i=0; i<5; i++) {
+                if (e->lfn.name1[i] == 0 || e->lfn.name1[i] == 0xffff) goto have_curPartLen;
+                curPartLen++;
+            }
+            for (int i=0; i<6; i++) {
+                if (e->lfn.name2[i] == 0 || e->lfn.name2[i] == 0xffff) goto have_curPartLen;
+                curPartLen++;
+            }
+            for (int i=0; i<2; i++) {
+                if (e->lfn.name3[i] == 0 || e->lfn.name3[i] == 0xffff) goto have_curPartLen;
+                curPartLen++;
+            }
+        have_curPartLen:
+            curFilename-=curPartLen;
+            for (int i=0; i<curPartLen && i<5; i++) {
+                curFilename[i] = e->lfn.name1[i];
+            }
+            for (int i=5; i<curPartLen && i<5+6; i++) {
+                curFilename[i] = e->lfn.name2[i-5];
+            }
+            for (int i=5+6; i<curPartLen && i<5+6+2; i++) {
+                curFilename[i] = e->lfn.name3[i-(5+6)];
+            }
+            continue;
+        }
+
+        if (*e->dfe.shortFilename != 0x00 && *e->dfe.shortFilename != (char)0xFF && !(e->dfe.fileAttributes & FILEENTRY_ATTR_VOLUME_LABEL)) {
+            bool fileWasDeleted = (uint8_t)e->dfe.shortFilename[0] == 0xe5;
+            bool haveLongName = *curFilename && remainingSequences == 0 && lfn_checksum(e->dfe.shortFilename) == curChecksum;
+            uint32_t clusterLocation = e->dfe.clusterLocation | (IS_FAT32 ? (uint32_t)e->dfe.clusterNumber_High << 16 : 0);
+            FileEntry *cfe = findRootEntry(&e->dfe, haveLongName ? curFilename : NULL);
+
+            if (!cfe && !fileWasDeleted && clusterLocation >= FIRST_DATA_CLUSTER) {
+                //renamed: the name is new, but it still starts where one of ours does
+                FileEntry *owner = getFileForCluster(clusterLocation);
+                if (owner && owner->parent == kNoFile && owner->startCluster == clusterLocation) cfe = owner;
+            }
+
+            if (cfe) {
+                int32_t notice = updateRootEntry(cfe, &e->dfe, &clustersChanged);
+                if (notice < 0) {
+                    //the rest of the write is still applied, forgetting the slot makes the host's retry repeat the notice
+                    if (slot < _rootShadowSlots) _rootShadow[slot] = ~_rootShadow[slot];
+                    if (!failed) failed = notice;
+                }
+            }else if (haveLongName && !fileWasDeleted && (_newfilecb || _newfilecbCtx)) {
+                _inNewfileCallback = true;
+                if (_newfilecb) _newfilecb(curFilename,e->dfe.filenameExt,e->dfe.fileSize, clusterLocation);
+                if (_newfilecbCtx) _newfilecbCtx(_newfilecbCtxArg, curFilename,e->dfe.filenameExt,e->dfe.fileSize, clusterLocation);
+                _inNewfileCallback = false;
+            }
         }
+        RESETLFN;
+    }
+
+    if (offset + size > ROOT_DIRECTORY_BYTES) size = static_cast<uint32_t>(ROOT_DIRECTORY_BYTES - offset);
+    didWrite += size;
+    
+error:
+    if (clustersChanged) {
+        rebuildClusterIndex();
+        invalidateDirectoryCaches();
+        _chainsDirty = true;
+    }
+    if (err) {
+        return -err;
+    }
+    if (failed) return failed;
+    return didWrite;
+#undef RESETLFN
+#undef MOVEOFFSET
+}
+
+int32_t EmuFATFSBase::catchFileAllocationTableAccess(uint32_t offset, const void *buf, uint32_t size){
+    int err = 0;
+    const uint8_t *fe = (const uint8_t*)buf;
+    const uint8_t entryShift = IS_FAT32 ? 2 : 1;
+    const uint32_t entryMask = IS_FAT32 ? 0x0FFFFFFF : 0xFFFF;
+    uint32_t findex = offset >> entryShift;
+    uint32_t fend = 0;
+    uint32_t runStart = 0;
+    bool inRun = false;
+
+    //exFAT files are contiguous, there are no chains to follow
+    if (IS_EXFAT) return size;
+    cretassure((size & ((1u << entryShift)-1)) == 0, "write size needs to be entry aligned!");
+    cretassure((offset & ((1u << entryShift)-1)) == 0, "offset needs to be entry aligned!");
+    fend = findex + (size >> entryShift);
+    
+    /*
+        Entries of emulated clusters are ours, everything else is collapsed into runs of
+        consecutive clusters and kept in the chain extents
+     */
+    for (; findex < fend; findex++, fe += 1u << entryShift) {
+        uint32_t value = 0;
+        if (findex < FIRST_DATA_CLUSTER || isEmulatedCluster(findex)) continue;
+        memcpy(&value, fe, 1u << entryShift);
+        value &= entryMask;
         
-        for (int z=neededExtraEntries-2; z>=0; z--) {
-            if (DTINDEX == processedEntries++){
-                MOVEOFFSET;
+        if (value == findex+1 && findex+1 < fend && !isEmulatedCluster(findex+1)) {
+            if (!inRun) runStart = findex;
+            inRun = true;
+            continue;
+        }
+        if (!inRun) runStart = findex;
+        inRun = false;
+        if (!value && runStart < findex) {
+            //a free entry ends the run in front of it
+            cretassure(!storeChainExtent(runStart, findex - runStart, findex), "Failed to store chain");
+            runStart = findex;
+        }
+        cretassure(!storeChainExtent(runStart, findex - runStart + 1, value), "Failed to store chain");
+    }
+    
+error:
+    if (err) {
+        return -err;
+    }
+    return size;
+}
+
+uint32_t EmuFATFSBase::dataRegionChunk(uint64_t offset, uint32_t size, const FileEntry **outFile){
+    uint32_t cluster = static_cast<uint32_t>(offset >> CLUSTER_SHIFT) + FIRST_DATA_CLUSTER;
+    uint16_t idx = clusterIndexUpperBound(cluster);
+    const FileEntry *cfe = idx ? &_fileStorage[_clusterIndex[idx-1]] : NULL;
+    
+    if (cfe && cluster - cfe->startCluster < cfe->clusterCount) {
+        uint64_t fileEnd = (uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER + cfe->clusterCount) << CLUSTER_SHIFT;
+        if (size > fileEnd - offset) size = static_cast<uint32_t>(fileEnd - offset);
+    }else{
+        //unallocated space up to the next file
+        cfe = NULL;
+        if (idx < _clusterIndexCnt) {
+            uint64_t nextStart = (uint64_t)(_fileStorage[_clusterIndex[idx]].startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+            if (size > nextStart - offset) size = static_cast<uint32_t>(nextStart - offset);
+        }
+    }
+    *outFile = cfe;
+    return size;
+}
+
+bool EmuFATFSBase::chainRegionChunk(uint64_t offset, uint32_t *size, const FileEntry **outFile, uint64_t *outFileOffset){
+    uint32_t cluster = static_cast<uint32_t>(offset >> CLUSTER_SHIFT) + FIRST_DATA_CLUSTER;
+    uint16_t idx = chainExtentUpperBound(cluster);
+    const ChainExtent *ext = idx ? &_chainExtents[idx-1] : NULL;
+    
+    *outFile = NULL;
+    if (!ext || cluster - ext->startCluster >= ext->clusterCount) {
+        //everything up to the next host written extent is left to dataRegionChunk
+        if (idx < _chainExtentsCnt) {
+            uint64_t nextStart = (uint64_t)(_chainExtents[idx].startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+            if (*size > nextStart - offset) *size = static_cast<uint32_t>(nextStart - offset);
+        }
+        return false;
+    }
+    
+    uint64_t extentEnd = (uint64_t)(ext->startCluster - FIRST_DATA_CLUSTER + ext->clusterCount) << CLUSTER_SHIFT;
+    if (*size > extentEnd - offset) *size = static_cast<uint32_t>(extentEnd - offset);
+    if (ext->fileIdx != kNoFile) {
+        *outFile = &_fileStorage[ext->fileIdx];
+        *outFileOffset = ((uint64_t)(ext->fileCluster + cluster - ext->startCluster) << CLUSTER_SHIFT) | (offset & (BYTES_PER_CLUSTER-1));
+    }
+    return true;
+}
+
+int32_t EmuFATFSBase::fileRead(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size){
+    uint16_t fileIdx = (uint16_t)(cfe - _fileStorage);
+    int32_t didRead = 0;
+
+    if (_readAheadSlots && (didRead = readAheadLookup(fileIdx, offset, buf, size))) {
+        //prefetched
+    }else if (_readCacheBlocks && !_sharedReaders && !cfe->f_readAsync) {
+        didRead = cachedRead(cfe, offset, buf, size);
+    }else{
+        didRead = fileReadThrough(cfe, offset, buf, size);
+    }
+
+    if (didRead > 0 && fileIdx == _writeBufferFile) {
+        //the provider doesn't have the pending writes yet
+        uint64_t start = _writeBufferBase + _writeBufferStart;
+        uint64_t end = _writeBufferBase + _writeBufferEnd;
+        if (start < offset) start = offset;
+        if (end > offset + didRead) end = offset + didRead;
+        if (start < end) memcpy((uint8_t*)buf + (start - offset), &_writeBuffer[start - _writeBufferBase], static_cast<size_t>(end - start));
+    }
+    return didRead;
+}
+
+int32_t EmuFATFSBase::fileReadThrough(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size){
+    int32_t didRead = 0;
+    uint64_t statsStart = statsTicks();
+
+    if (cfe->f_readCtx) {
+        didRead = cfe->f_readCtx(cfe->ctx, (uint16_t)(cfe - _fileStorage), offset, buf, size);
+    }else if (cfe->f_readAsync) {
+        _syncRequest.state.store(kHostRequestWaiting, std::memory_order_relaxed);
+        didRead = waitProviderIO(cfe->f_readAsync(cfe->ctx, (uint16_t)(cfe - _fileStorage), offset, buf, size, kSyncProviderToken));
+    }else if (cfe->f_read) {
+        //legacy providers only back files below 4GiB
+        didRead = cfe->f_read(static_cast<uint32_t>(offset), buf, size, cfe->filename);
+    }else{
+        const void *ref = NULL;
+        didRead = cfe->f_readRef(static_cast<uint32_t>(offset), &ref, size, cfe->filename);
+        if (didRead > 0) memcpy(buf, ref, didRead);
+    }
+    if (STATS_ACTIVE) recordProviderCall(cfe, false, statsStart);
+    return didRead;
+}
+
+uint32_t EmuFATFSBase::readAheadLookup(uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size){
+    for (uint16_t i=0; i<_readAheadSlotCount; i++) {
+        ReadAheadSlot *slot = &_readAheadSlots[i];
+        if (slot->state.load(std::memory_order_acquire) != kReadAheadValid) continue;
+        if (slot->stale || slot->fileIdx != fileIdx || offset < slot->offset || offset - slot->offset >= slot->length) continue;
+        uint32_t slotOffset = static_cast<uint32_t>(offset - slot->offset);
+        if (size > slot->length - slotOffset) size = slot->length - slotOffset;
+        memcpy(buf, &slot->data[slotOffset], size);
+        return size;
+    }
+    return 0;
+}
+
+void EmuFATFSBase::trackSequentialRead(uint16_t fileIdx, uint64_t offset, uint32_t size){
+    FileEntry *cfe = &_fileStorage[fileIdx];
+    
+    //async providers overlap their transfers through the request queue instead
+    if (cfe->f_readAsync) return;
+    if (offset == cfe->lastReadEnd) {
+        if (cfe->sequentialReads < kReadAheadTrigger) cfe->sequentialReads++;
+    }else{
+        cfe->sequentialReads = 0;
+    }
+    cfe->lastReadEnd = offset + size;
+    if (cfe->sequentialReads >= kReadAheadTrigger) scheduleReadAhead(fileIdx, offset, offset + size);
+}
+
+void EmuFATFSBase::scheduleReadAhead(uint16_t fileIdx, uint64_t readStart, uint64_t readEnd){
+    const FileEntry *cfe = &_fileStorage[fileIdx];
+    uint64_t chunk = readEnd & ~(uint64_t)(_readAheadSlotSize-1);
+    
+    for (uint16_t n=0; n<_readAheadSlotCount && chunk < cfe->fileSize; n++, chunk += _readAheadSlotSize) {
+        ReadAheadSlot *victim = NULL;
+        bool isScheduled = false;
+        for (uint16_t i=0; i<_readAheadSlotCount; i++) {
+            ReadAheadSlot *slot = &_readAheadSlots[i];
+            uint8_t state = slot->state.load(std::memory_order_acquire);
+            if (state != kReadAheadFree && !slot->stale && slot->fileIdx == fileIdx && slot->offset == chunk) {
+                isScheduled = true;
+                break;
+            }
+            /*
+                Pending and Loading slots belong to prefetch(), loaded ones may be recycled once the reader
+                moved past them (or they belong to another file)
+             */
+            if (!victim && (state == kReadAheadFree || (state == kReadAheadValid && (slot->stale || slot->fileIdx != fileIdx || slot->offset + slot->length <= readStart)))) {
+                victim = slot;
             }
         }
+        if (isScheduled) continue;
+        if (!victim) break;
+        victim->fileIdx = fileIdx;
+        victim->offset = chunk;
+        victim->length = cfe->fileSize - chunk < _readAheadSlotSize ? static_cast<uint32_t>(cfe->fileSize - chunk) : _readAheadSlotSize;
+        victim->stale = false;
+        victim->state.store(kReadAheadPending, std::memory_order_release);
+    }
+}
 
-        if (DTINDEX == processedEntries++){
-            if (size < sizeof(FAT_DirectoryTableEntry_t)) goto error;
-            const FAT_DirectoryTableFileEntry_t *dfe = (const FAT_DirectoryTableFileEntry_t*)ptr;
-            bool fileWasDeleted = false;
-            fileWasDeleted = ((uint8_t)dfe->shortFilename[0] == 0xe5);
-            if (fileWasDeleted || (dfe->fileSize == 0 && cfe->fileSize != 0)){
-              cfe->startCluster = 0;
-              if (cfe->f_write) cfe->f_write(-1, NULL, 0, cfe->filename);
-            }else if (cfe->isDynamicFile){
-              uint16_t oldClusterCount = cfe->fileSize / bytesPerCluster();
-              uint16_t newClusterCount = dfe->fileSize / bytesPerCluster();
+uint16_t *EmuFATFSBase::readCacheBucket(uint16_t fileIdx, uint64_t blockOffset){
+    //block offsets have their low bits clear, the top of the product depends on all of them
+    uint64_t h = (blockOffset ^ ((uint64_t)fileIdx << 48)) * 0x9E3779B97F4A7C15;
+    return &_readCacheIndex[(h >> 48) & (_readCacheIndexSize-1)];
+}
 
-              if (cfe->fileSize & (bytesPerCluster()-1)) oldClusterCount++;
-              if (dfe->fileSize & (bytesPerCluster()-1)) newClusterCount++;
+EmuFATFSBase::ReadCacheBlock *EmuFATFSBase::readCacheLookup(uint16_t fileIdx, uint64_t blockOffset){
+    for (uint16_t i = *readCacheBucket(fileIdx, blockOffset); i != kNoFile; i = _readCacheBlocks[i].nextInBucket) {
+        ReadCacheBlock *blk = &_readCacheBlocks[i];
+        if (blk->fileIdx == fileIdx && blk->offset == blockOffset) return blk;
+    }
+    return NULL;
+}
 
-              if (!oldClusterCount) oldClusterCount = 1;
-              if (!newClusterCount) newClusterCount = 1;
+void EmuFATFSBase::readCacheLink(ReadCacheBlock *blk, uint16_t fileIdx, uint64_t blockOffset, uint32_t length){
+    uint16_t *bucket = readCacheBucket(fileIdx, blockOffset);
+    blk->offset = blockOffset;
+    blk->length = length;
+    blk->fileIdx = fileIdx;
+    blk->referenced = false;
+    blk->nextInBucket = *bucket;
+    *bucket = (uint16_t)(blk - _readCacheBlocks);
+}
 
-              cfe->startCluster = dfe->clusterLocation;
-              if (oldClusterCount == newClusterCount){
-                cfe->fileSize = dfe->fileSize;
-              }
+void EmuFATFSBase::readCacheDrop(ReadCacheBlock *blk){
+    uint16_t *link = NULL;
+    if (blk->fileIdx == kNoFile) return;
+    for (link = readCacheBucket(blk->fileIdx, blk->offset); *link != kNoFile; link = &_readCacheBlocks[*link].nextInBucket) {
+        if (&_readCacheBlocks[*link] == blk) {
+            *link = blk->nextInBucket;
+            break;
+        }
+    }
+    blk->fileIdx = kNoFile;
+}
+
+EmuFATFSBase::ReadCacheBlock *EmuFATFSBase::readCacheVictim(){
+    //CLOCK: blocks which were hit since the hand last passed get a second chance
+    for (;;) {
+        ReadCacheBlock *blk = &_readCacheBlocks[_readCacheHand];
+        _readCacheHand = (uint16_t)((_readCacheHand + 1) % _readCacheBlockCount);
+        if (blk->fileIdx == kNoFile) return blk;
+        if (!blk->referenced) {
+            _readCacheStats.evictions++;
+            readCacheDrop(blk);
+            return blk;
+        }
+        blk->referenced = false;
+    }
+}
+
+void EmuFATFSBase::readCacheInsert(uint16_t fileIdx, uint64_t blockOffset, const void *data, uint32_t length){
+    ReadCacheBlock *blk = readCacheLookup(fileIdx, blockOffset);
+    if (blk) readCacheDrop(blk);
+    else blk = readCacheVictim();
+    memcpy(blk->data, data, length);
+    readCacheLink(blk, fileIdx, blockOffset, length);
+}
+
+int32_t EmuFATFSBase::cachedRead(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size){
+    uint16_t fileIdx = (uint16_t)(cfe - _fileStorage);
+    uint64_t blockOffset = offset & ~(uint64_t)(_readCacheBlockSize-1);
+    uint32_t inBlock = static_cast<uint32_t>(offset - blockOffset);
+    ReadCacheBlock *blk = readCacheLookup(fileIdx, blockOffset);
+    int32_t didRead = 0;
+
+    if (blk && inBlock < blk->length) {
+        _readCacheStats.hits++;
+        blk->referenced = true;
+        if (size > blk->length - inBlock) size = blk->length - inBlock;
+        memcpy(buf, &blk->data[inBlock], size);
+        return size;
+    }
+    _readCacheStats.misses++;
+
+    if (size >= _readCacheBlockSize) {
+        //large reads go straight into buf, only the whole blocks they covered are kept
+        uint64_t pos = (offset + _readCacheBlockSize-1) & ~(uint64_t)(_readCacheBlockSize-1);
+        didRead = fileReadThrough(cfe, offset, buf, size);
+        for (; didRead > 0 && pos + _readCacheBlockSize <= offset + didRead; pos += _readCacheBlockSize) {
+            readCacheInsert(fileIdx, pos, (uint8_t*)buf + (pos - offset), _readCacheBlockSize);
+        }
+        return didRead;
+    }
+
+    {
+        //load the whole block, the tail of the file may end inside of it
+        uint32_t length = _readCacheBlockSize;
+        if (cfe->fileSize - blockOffset < length) length = static_cast<uint32_t>(cfe->fileSize - blockOffset);
+        if (blk) readCacheDrop(blk);
+        else blk = readCacheVictim();
+        didRead = fileReadThrough(cfe, blockOffset, blk->data, length);
+        if (didRead <= (int32_t)inBlock) return fileReadThrough(cfe, offset, buf, size);
+        readCacheLink(blk, fileIdx, blockOffset, didRead);
+    }
+    if (size > blk->length - inBlock) size = blk->length - inBlock;
+    memcpy(buf, &blk->data[inBlock], size);
+    return size;
+}
+
+void EmuFATFSBase::invalidateReadAhead(uint16_t fileIdx, uint64_t start, uint64_t end){
+    for (uint16_t i=0; i<_readAheadSlotCount; i++) {
+        ReadAheadSlot *slot = &_readAheadSlots[i];
+        if (fileIdx != kNoFile && (slot->fileIdx != fileIdx || slot->offset >= end || slot->offset + slot->length <= start)) continue;
+        //the slot may still be in flight, so only mark it and let the scheduler recycle it
+        slot->stale = true;
+    }
+}
+
+int32_t EmuFATFSBase::fileWrite(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size){
+    if (_readAheadSlots && buf) invalidateReadAhead((uint16_t)(cfe - _fileStorage), offset, offset + size);
+    if (_writeBuffer && buf) return bufferedWrite(cfe, offset, buf, size);
+    {
+        //anything else (e.g. the deletion notice) must not overtake pending data
+        int err = flush();
+        if (err) return err;
+    }
+    {
+        int32_t didWrite = fileWriteThrough(cfe, offset, buf, size);
+        if (didWrite < 0) return didWrite;
+    }
+    return size;
+}
+
+int32_t EmuFATFSBase::bufferedWrite(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size){
+    const uint8_t *ptr = (const uint8_t*)buf;
+    uint16_t fileIdx = (uint16_t)(cfe - _fileStorage);
+    int32_t didWrite = 0;
+
+    _writeStats.hostWrites++;
+    _writeStats.hostBytes += size;
+    while (size) {
+        uint32_t chunk = 0;
+        int err = 0;
+        if (_writeBufferFile != kNoFile && (_writeBufferFile != fileIdx || offset != _writeBufferBase + _writeBufferEnd)) {
+            if ((err = flush())) return err;
+        }
+        if (_writeBufferFile == kNoFile) {
+            _writeBufferFile = fileIdx;
+            _writeBufferBase = offset & ~(uint64_t)(_writeBlockSize-1);
+            _writeBufferStart = _writeBufferEnd = static_cast<uint32_t>(offset - _writeBufferBase);
+        }
+        chunk = _writeBufferSize - _writeBufferEnd;
+        if (chunk > size) chunk = size;
+        memcpy(&_writeBuffer[_writeBufferEnd], ptr, chunk);
+        _writeBufferEnd += chunk;
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+        didWrite += chunk;
+        //this write stays buffered, but the host has to repeat it to learn whether it made it out
+        if (_writeBufferEnd == _writeBufferSize && (err = flush())) return err;
+    }
+    return didWrite;
+}
+
+int32_t EmuFATFSBase::fileWriteThrough(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size){
+    int32_t didWrite = 0;
+    uint64_t statsStart = 0;
+
+    if (_readCacheBlocks) invalidateReadCache((uint16_t)(cfe - _fileStorage), offset, size);
+    statsStart = statsTicks();
+
+    if (cfe->f_writeCtx) {
+        didWrite = cfe->f_writeCtx(cfe->ctx, (uint16_t)(cfe - _fileStorage), offset, buf, size);
+    }else if (cfe->f_write) {
+        didWrite = cfe->f_write(static_cast<uint32_t>(offset), buf, size, cfe->filename);
+    }else if (cfe->f_writeAsync) {
+        _syncRequest.state.store(kHostRequestWaiting, std::memory_order_relaxed);
+        didWrite = waitProviderIO(cfe->f_writeAsync(cfe->ctx, (uint16_t)(cfe - _fileStorage), offset, buf, size, kSyncProviderToken));
+    }else{
+        return 0;
+    }
+    if (STATS_ACTIVE) recordProviderCall(cfe, true, statsStart);
+    return didWrite;
+}
+
+int32_t EmuFATFSBase::waitProviderIO(int started){
+    if (started < 0) return started;
+    while (_syncRequest.state.load(std::memory_order_acquire) != kHostRequestProviderDone);
+    return _syncRequest.providerResult;
+}
+
+uint32_t EmuFATFSBase::asyncChunk(uint64_t offset, uint32_t size, bool isWrite, const FileEntry **outFile, uint64_t *outFileOffset){
+    uint64_t dataOffset = SECTOR_OFFSET(SECTOR_DATA_REGION);
+    const FileEntry *cfe = NULL;
+    uint64_t sectionOffset = 0;
+    uint64_t fileOffset = 0;
+    *outFile = NULL;
+    
+    //only file data goes to async providers, everything in front of the data region is generated
+    if (offset < dataOffset) return dataOffset - offset < size ? static_cast<uint32_t>(dataOffset - offset) : size;
+    sectionOffset = offset - dataOffset;
+    
+    if (_chainExtentsCnt && chainRegionChunk(sectionOffset, &size, &cfe, &fileOffset)) {
+        //host allocated clusters
+    }else{
+        size = dataRegionChunk(sectionOffset, size, &cfe);
+        if (cfe) fileOffset = sectionOffset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+    }
+    if (!cfe || fileOffset >= cfe->fileSize) return size;
+    //buffered writes are collected synchronously, flush() hands them over
+    if (isWrite ? (!cfe->f_writeAsync || _writeBuffer) : !cfe->f_readAsync) return size;
+    
+    if (size > cfe->fileSize - fileOffset) size = static_cast<uint32_t>(cfe->fileSize - fileOffset);
+    *outFile = cfe;
+    *outFileOffset = fileOffset;
+    return size;
+}
+
+int EmuFATFSBase::startRequestIO(HostRequest *req, uint16_t requestId, const FileEntry *cfe, uint64_t fileOffset, uint32_t size){
+    uint16_t fileIdx = (uint16_t)(cfe - _fileStorage);
+    int err = 0;
+    
+    //the provider has to see pending writes before it can serve the read
+    if (!req->isWrite && fileIdx == _writeBufferFile) flush();
+    if (req->isWrite && _readCacheBlocks) invalidateReadCache(fileIdx, fileOffset, size);
+    req->providerSize = size;
+    req->providerStart = statsTicks();
+    req->state.store(kHostRequestWaiting, std::memory_order_relaxed);
+    if (STATS_ACTIVE && fileIdx < _fileStatsCnt) (req->isWrite ? _fileStats[fileIdx].writes : _fileStats[fileIdx].reads).fetch_add(1, std::memory_order_relaxed);
+    if (req->isWrite) {
+        err = cfe->f_writeAsync(cfe->ctx, fileIdx, fileOffset, &req->buf[req->done], size, requestId);
+    }else{
+        err = cfe->f_readAsync(cfe->ctx, fileIdx, fileOffset, &req->buf[req->done], size, requestId);
+    }
+    if (err < 0) req->state.store(kHostRequestQueued, std::memory_order_relaxed);
+    return err;
+}
+
+int EmuFATFSBase::advanceRequest(uint16_t requestId){
+    HostRequest *req = &_requests[requestId];
+    int32_t result = 0;
+    
+    for (;;) {
+        uint8_t state = req->state.load(std::memory_order_acquire);
+        const FileEntry *cfe = NULL;
+        uint64_t fileOffset = 0;
+        uint64_t offset = 0;
+        uint32_t chunk = 0;
+        
+        if (state == kHostRequestFree) return 0;
+        if (state == kHostRequestWaiting) return 1;
+        if (state == kHostRequestProviderDone) {
+            int32_t r = req->providerResult;
+            req->state.store(kHostRequestQueued, std::memory_order_relaxed);
+            //the request fails as a whole, whatever came before is in done but isn't reported
+            if (r < 0) {
+                result = r;
+                break;
             }
-            MOVEOFFSET;
+            if (r > 0 && (uint32_t)r < req->providerSize) {
+                //short transfer, the rest gets issued again
+                req->done += r;
+            }else{
+                if (r == 0 && !req->isWrite) memset(&req->buf[req->done], 0, req->providerSize);
+                req->done += req->providerSize;
+            }
+        }
+        if (req->done == req->size) break;
+        
+        offset = req->offset + req->done;
+        chunk = asyncChunk(offset, req->size - req->done, req->isWrite, &cfe, &fileOffset);
+        if (cfe) {
+            int started = startRequestIO(req, requestId, cfe, fileOffset, chunk);
+            if (!started) continue;
+            result = started;
+            break;
+        }else if (req->isWrite) {
+            int32_t didWrite = writeRegions(offset, &req->buf[req->done], chunk);
+            if (didWrite < 0) {
+                result = didWrite;
+                break;
+            }
+        }else{
+            readRegions(offset, &req->buf[req->done], chunk);
+        }
+        req->done += chunk;
+    }
+    
+    if (!result) result = (int32_t)req->done;
+    req->state.store(kHostRequestFree, std::memory_order_relaxed);
+    _requestCount--;
+    if (req->cb) req->cb(req->ctx, requestId, result);
+    return result < 0 ? result : 0;
+}
+
+int EmuFATFSBase::submitRequest(bool isWrite, uint64_t offset, void *buf, uint32_t size, cb_hostComplete cb, void *ctx){
+    int err = 0;
+    uint16_t requestId = 0;
+    HostRequest *req = NULL;
+    
+    cretassure(_requests, "No request queue registered");
+    cretassure(_requestCount < _requestDepth, "Request queue is full");
+    //next fit, requests completing out of order leave free slots anywhere in the ring
+    requestId = _requestNext;
+    while (_requests[requestId].state.load(std::memory_order_relaxed) != kHostRequestFree) requestId = (uint16_t)((requestId + 1) % _requestDepth);
+    _requestNext = (uint16_t)((requestId + 1) % _requestDepth);
+    req = &_requests[requestId];
+    req->isWrite = isWrite;
+    req->offset = offset;
+    req->buf = (uint8_t*)buf;
+    req->size = size;
+    req->done = 0;
+    req->providerSize = 0;
+    req->providerResult = 0;
+    req->cb = cb;
+    req->ctx = ctx;
+    req->state.store(kHostRequestQueued, std::memory_order_relaxed);
+    _requestCount++;
+    finalize();
+    noteHostAccess(isWrite, offset, size, isWrite ? buf : NULL);
+    return requestId;
+    
+error:
+    return -err;
+}
+
+uint32_t EmuFATFSBase::usedClusterEnd(){
+    uint32_t end = FIRST_FILE_CLUSTER;
+    
+    if (_clusterHighWater > end) end = _clusterHighWater;
+    if (IS_EXFAT && _bitmapCluster + _bitmapClusters > end) end = _bitmapCluster + _bitmapClusters;
+    if (_chainExtentsCnt) {
+        const ChainExtent *ext = &_chainExtents[_chainExtentsCnt-1];
+        if (ext->startCluster + ext->clusterCount > end) end = ext->startCluster + ext->clusterCount;
+    }
+    return end;
+}
+
+uint32_t EmuFATFSBase::allocatedClusters(){
+    //union of the root directory, the files and the host written chains, the latter two are sorted by startCluster
+    uint32_t allocated = FIRST_FILE_CLUSTER - FIRST_DATA_CLUSTER;
+    uint32_t coveredEnd = FIRST_FILE_CLUSTER;
+    uint16_t f = 0;
+    uint16_t c = 0;
+    
+    while (f < _clusterIndexCnt || c < _chainExtentsCnt) {
+        uint32_t start = 0;
+        uint32_t end = 0;
+        if (c == _chainExtentsCnt || (f < _clusterIndexCnt && _fileStorage[_clusterIndex[f]].startCluster <= _chainExtents[c].startCluster)) {
+            const FileEntry *cfe = &_fileStorage[_clusterIndex[f++]];
+            start = cfe->startCluster;
+            end = start + cfe->clusterCount;
+        }else{
+            const ChainExtent *ext = &_chainExtents[c++];
+            start = ext->startCluster;
+            end = start + ext->clusterCount;
         }
+        if (start < coveredEnd) start = coveredEnd;
+        if (end <= start) continue;
+        allocated += end - start;
+        coveredEnd = end;
     }
+    return allocated;
+}
+
+uint64_t EmuFATFSBase::extentAt(uint64_t offset, ExtentType *outType){
+#define SECTOR_ALIGN(x) (((uint64_t)(x) + BYTES_PER_SECTOR-1) & ~(uint64_t)(BYTES_PER_SECTOR-1))
+    uint64_t sectorNum = offset >> _bytesPerSectorShift;
+    uint64_t dataOffset = SECTOR_OFFSET(SECTOR_DATA_REGION);
+    uint64_t sectionOffset = 0;
+    uint64_t limit = SECTOR_OFFSET(TOTAL_SECTORS) - dataOffset;
+    const FileEntry *cfe = NULL;
+    uint64_t fileOffset = 0;
+    uint32_t size = 0;
+    
+    *outType = kExtentData;
+    if (sectorNum < SECTOR_FAT_1) return SECTOR_OFFSET(SECTOR_FAT_1);
     
+    if (sectorNum < SECTOR_ROOT_DIRECTORY) {
+        //entries up to the highest cluster in use, free clusters behind it are zero entries
+        uint64_t fatStart = sectorNum < SECTOR_FAT_2 ? SECTOR_OFFSET(SECTOR_FAT_1) : SECTOR_OFFSET(SECTOR_FAT_2);
+        uint64_t fatBytes = SECTOR_OFFSET(SECTORS_PER_FAT);
+        uint64_t usedBytes = SECTOR_ALIGN((uint64_t)usedClusterEnd() << (IS_FAT32 || IS_EXFAT ? 2 : 1));
+        if (usedBytes > fatBytes) usedBytes = fatBytes;
+        if (offset < fatStart + usedBytes) return fatStart + usedBytes;
+        *outType = kExtentZero;
+        return fatStart + fatBytes;
+    }
+    
+    if (sectorNum < SECTOR_DATA_REGION) {
+        uint64_t rootStart = SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY);
+        uint64_t usedBytes = SECTOR_ALIGN(_rootDirectoryEntries * sizeof(FAT_DirectoryTableEntry_t));
+        if (offset < rootStart + usedBytes) return rootStart + usedBytes;
+        *outType = kExtentZero;
+        return dataOffset;
+    }
+    
+    sectionOffset = offset - dataOffset;
+    if (_rootDirectoryClusters && sectionOffset < ROOT_DIRECTORY_BYTES) {
+        uint64_t usedBytes = SECTOR_ALIGN(_rootDirectoryEntries * sizeof(FAT_DirectoryTableEntry_t));
+        if (sectionOffset < usedBytes) return dataOffset + usedBytes;
+        *outType = kExtentZero;
+        return dataOffset + ROOT_DIRECTORY_BYTES;
+    }
+    if (IS_EXFAT) {
+        uint64_t upcaseOffset = (uint64_t)(UPCASE_CLUSTER - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        uint64_t bitmapOffset = (uint64_t)(_bitmapCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        uint64_t bitmapEnd = bitmapOffset + ((uint64_t)_bitmapClusters << CLUSTER_SHIFT);
+        if (sectionOffset >= upcaseOffset && sectionOffset < upcaseOffset + BYTES_PER_CLUSTER) return dataOffset + upcaseOffset + BYTES_PER_CLUSTER;
+        if (sectionOffset >= bitmapOffset && sectionOffset < bitmapEnd) return dataOffset + bitmapEnd;
+        if (sectionOffset < bitmapOffset) limit = bitmapOffset;
+    }
+    
+    size = limit - sectionOffset < 0x80000000 ? static_cast<uint32_t>(limit - sectionOffset) : 0x80000000;
+    if (_chainExtentsCnt && chainRegionChunk(sectionOffset, &size, &cfe, &fileOffset)) {
+        //host written chains only read back through the dynamic file owning them
+        if (!cfe) *outType = kExtentZero;
+        return dataOffset + sectionOffset + size;
+    }
+    size = dataRegionChunk(sectionOffset, size, &cfe);
+    if (!cfe) {
+        *outType = kExtentUnallocated;
+    }else{
+        uint64_t usedBytes = SECTOR_ALIGN(cfe->fileSize);
+        fileOffset = sectionOffset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+        if (fileOffset >= usedBytes) *outType = kExtentZero;
+        else if (size > usedBytes - fileOffset) size = static_cast<uint32_t>(usedBytes - fileOffset);
+    }
+    return dataOffset + sectionOffset + size;
+#undef SECTOR_ALIGN
+}
+
+void EmuFATFSBase::recordLatency(LatencyHistogram *hist, uint64_t startTicks){
+    uint64_t ticks = _statsClock() - startTicks;
+    uint8_t bucket = ticks ? static_cast<uint8_t>(64 - __builtin_clzll(ticks)) : 0;
+    if (bucket >= kLatencyBuckets) bucket = kLatencyBuckets-1;
+    hist->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void EmuFATFSBase::recordProviderCall(const FileEntry *cfe, bool isWrite, uint64_t startTicks){
+    uint16_t fileIdx = (uint16_t)(cfe - _fileStorage);
+    if (fileIdx < _fileStatsCnt) (isWrite ? _fileStats[fileIdx].writes : _fileStats[fileIdx].reads).fetch_add(1, std::memory_order_relaxed);
+    if (isWrite) STATS_LATENCY(providerWrite, startTicks);
+    else STATS_LATENCY(providerRead, startTicks);
+}
+
+void EmuFATFSBase::recordHostAccess(bool isWrite, uint64_t offset, uint32_t size){
+    RegionStats *regions = NULL;
+    uint64_t dataOffset = 0;
+    uint64_t end = offset + size;
+
+    if (!_stats) return;
+    regions = isWrite ? _stats->hostWrites : _stats->hostReads;
+    dataOffset = SECTOR_OFFSET(SECTOR_DATA_REGION);
     {
-        int remainingSequences = 0;
-        char curFilenameBuf[0x101] = {};
-        char *curFilename = &curFilenameBuf[0x100];
-        uint8_t curChecksum = 0;
+        //end of each region, FAT32 and exFAT have their root directory at the start of the data region
+        const uint64_t regionEnd[kStatsRegionCount] = {
+            SECTOR_OFFSET(SECTOR_FAT_1),
+            SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY),
+            _rootDirectoryClusters ? dataOffset + ROOT_DIRECTORY_BYTES : dataOffset,
+            UINT64_MAX
+        };
+        for (uint8_t r=0; r<kStatsRegionCount && offset < end; r++) {
+            uint64_t chunkEnd = end < regionEnd[r] ? end : regionEnd[r];
+            if (offset >= regionEnd[r]) continue;
+            regions[r].requests.fetch_add(1, std::memory_order_relaxed);
+            regions[r].bytes.fetch_add(chunkEnd - offset, std::memory_order_relaxed);
+            offset = chunkEnd;
+        }
+    }
+}
+
+void EmuFATFSBase::traceHostAccess(bool isWrite, uint64_t offset, uint32_t size, const void *payload){
+    TraceRecord record = {};
+    record.timestamp = _traceClock ? _traceClock() : 0;
+    record.offset = offset;
+    record.size = size;
+    record.op = isWrite ? kTraceWrite : kTraceRead;
+    _traceCb(_traceCtx, &record, isWrite ? payload : NULL);
+}
+
+uint32_t EmuFATFSBase::readDataRegion(uint64_t offset, void *buf, uint32_t size){
+    uint8_t *ptr = (uint8_t*)buf;
+    const FileEntry *cfe = NULL;
+    uint64_t fileOffset = 0;
+    uint32_t didRead = 0;
+
+    if (offset < ROOT_DIRECTORY_BYTES && _rootDirectoryClusters) {
+        if (size > ROOT_DIRECTORY_BYTES - offset) size = static_cast<uint32_t>(ROOT_DIRECTORY_BYTES - offset);
+        return readRootDirectory(static_cast<uint32_t>(offset), buf, size);
+    }
+
+    if (IS_EXFAT) {
+        uint64_t upcaseOffset = (uint64_t)(UPCASE_CLUSTER - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        uint64_t bitmapOffset = (uint64_t)(_bitmapCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        uint64_t bitmapEnd = bitmapOffset + ((uint64_t)_bitmapClusters << CLUSTER_SHIFT);
         
-        while (size >= sizeof(FAT_DirectoryTableEntry_t)) {
-            MOVEOFFSET;
-            FAT_DirectoryTableEntry_t *e = ((FAT_DirectoryTableEntry_t*)ptr)-1;
-            if (e->lfn.attributes == FILEENTRY_ATTR_LFN_ENTRY) {
-                if (remainingSequences == 0) {
-                    remainingSequences = 0;
-                    curFilename = &curFilenameBuf[0x100];
-                    curChecksum = 0;
-                    if ((e->lfn.sequenceNumber & 0xF0) == LFN_ENTRY_LAST) {
-                        remainingSequences = e->lfn.sequenceNumber & 0x3F;
-                        curChecksum = e->lfn.checksum;
-                    }
-                }
-                if ((e->lfn.sequenceNumber & 0x3F) != remainingSequences-- || e->lfn.checksum != curChecksum) {
-                    remainingSequences = 0;
-                    curFilename = &curFilenameBuf[0x100];
-                    curChecksum = 0;
-                    continue;
-                }
-                int curPartLen = 0;
-                for (int i=0; i<5; i++) {
-                    if (e->lfn.name1[i] == 0 || e->lfn.name1[i] == 0xffff) goto have_curPartLen;
-                    curPartLen++;
-                }
-                for (int i=0; i<6; i++) {
-                    if (e->lfn.name2[i] == 0 || e->lfn.name2[i] == 0xffff) goto have_curPartLen;
-                    curPartLen++;
-                }
-                for (int i=0; i<2; i++) {
-                    if (e->lfn.name3[i] == 0 || e->lfn.name3[i] == 0xffff) goto have_curPartLen;
-                    curPartLen++;
-                }
-            have_curPartLen:
-                curFilename-=curPartLen;
-                for (int i=0; i<curPartLen && i<5; i++) {
-                    curFilename[i] = e->lfn.name1[i];
-                }
-                for (int i=5; i<curPartLen && i<5+6; i++) {
-                    curFilename[i] = e->lfn.name2[i-5];
-                }
-                for (int i=5+6; i<curPartLen && i<5+6+2; i++) {
-                    curFilename[i] = e->lfn.name3[i-(5+6)];
-                }
-            }else if (_newfilecb){
-                if (*curFilename) {
-                    if (remainingSequences == 0 && lfn_checksum(e->dfe.shortFilename) == curChecksum) {
-                        _newfilecb(curFilename,e->dfe.filenameExt,e->dfe.fileSize, e->dfe.clusterLocation);
-                    }
-                }else if (*e->dfe.shortFilename != 0x00 && *e->dfe.shortFilename != (char)0xFF){
-                    int fnamelen = 0;
-                    for (; fnamelen < 8; fnamelen++) {
-                        char c = e->dfe.shortFilename[fnamelen];
-                        if (c == ' ') break;
-                        curFilenameBuf[fnamelen] = c;
-                    }
-                    if (e->dfe.filenameExt[0] != ' ') {
-                        curFilenameBuf[fnamelen++] = '.';
-                        curFilenameBuf[fnamelen++] = e->dfe.filenameExt[0];
-                        if (e->dfe.filenameExt[1] != ' ') {
-                            curFilenameBuf[fnamelen++] = e->dfe.filenameExt[1];
-                            if (e->dfe.filenameExt[2] != ' ') curFilenameBuf[fnamelen++] = e->dfe.filenameExt[2];
-                        }
-                    }
-                    curFilenameBuf[fnamelen] = '\0';
-                    // _newfilecb(curFilenameBuf,e->dfe.filenameExt,e->dfe.fileSize);
-                }
-                remainingSequences = 0;
-                curFilename = &curFilenameBuf[0x100];
-                curChecksum = 0;
+        if (offset >= upcaseOffset && offset < upcaseOffset + BYTES_PER_CLUSTER) {
+            if (size > upcaseOffset + BYTES_PER_CLUSTER - offset) size = static_cast<uint32_t>(upcaseOffset + BYTES_PER_CLUSTER - offset);
+            return readUpcaseTable(static_cast<uint32_t>(offset - upcaseOffset), buf, size);
+        }else if (offset >= bitmapOffset && offset < bitmapEnd) {
+            if (size > bitmapEnd - offset) size = static_cast<uint32_t>(bitmapEnd - offset);
+            return readAllocationBitmap(static_cast<uint32_t>(offset - bitmapOffset), buf, size);
+        }else if (offset < bitmapOffset && size > bitmapOffset - offset) {
+            size = static_cast<uint32_t>(bitmapOffset - offset);
+        }
+    }
+
+    if (_chainExtentsCnt && chainRegionChunk(offset, &size, &cfe, &fileOffset)) {
+        //host allocated clusters, cfe is only set once a dynamic file owns the chain
+    }else{
+        size = dataRegionChunk(offset, size, &cfe);
+        if (cfe && cfe->isDirectory) {
+            uint32_t directoryOffset = static_cast<uint32_t>(offset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT));
+            return readDirectory(static_cast<uint16_t>(cfe - _fileStorage), directoryOffset, buf, size);
+        }
+        if (cfe) fileOffset = offset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+    }
+    
+    if (cfe) {
+        if (fileOffset < cfe->fileSize) {
+            uint32_t wantRead = size;
+            if (cfe->fileSize - fileOffset < wantRead) wantRead = static_cast<uint32_t>(cfe->fileSize - fileOffset);
+            if (_readAheadSlots) trackSequentialRead((uint16_t)(cfe - _fileStorage), fileOffset, wantRead);
+            while (didRead < wantRead) {
+                int32_t r = fileRead(cfe, fileOffset + didRead, &ptr[didRead], wantRead - didRead);
+                if (r <= 0) break;
+                didRead += r;
             }
         }
     }
+    memset(&ptr[didRead], 0, size-didRead);
+    
+    return size;
+}
+
+void EmuFATFSBase::updateGeometry(){
+    if (IS_FAT32) {
+        /*
+            The volume has the fixed size of _volumeBytes (at least the FAT32 minimum and what the files use),
+            the FAT for the free clusters is generated on demand, so neither memory nor work grows with it
+         */
+        uint64_t dataClusters = _volumeBytes >> CLUSTER_SHIFT;
+        uint32_t usedEnd = FIRST_FILE_CLUSTER;
+        //every cluster costs SECTORS_PER_CLUSTER plus less than one FAT sector, all of it needs to fit the 32bit sector count
+        _clusterLimit = FIRST_DATA_CLUSTER + (0xFFFFFFFFu - kFAT32ReservedSectors - 2) / (SECTORS_PER_CLUSTER + 1);
+        if (_clusterLimit > FAT32_CLUSTER_LIMIT) _clusterLimit = FAT32_CLUSTER_LIMIT;
+        _rootDirectoryClusters = clustersForSize(kRootDirectoryBytes);
+        if (_clusterHighWater > usedEnd) usedEnd = _clusterHighWater;
+        if (dataClusters > _clusterLimit - FIRST_DATA_CLUSTER) dataClusters = _clusterLimit - FIRST_DATA_CLUSTER;
+        if (dataClusters < usedEnd - FIRST_DATA_CLUSTER) dataClusters = usedEnd - FIRST_DATA_CLUSTER;
+        if (dataClusters < kFAT32MinClusters) dataClusters = kFAT32MinClusters;
+
+        _reservedSectors = kFAT32ReservedSectors;
+        _sectorsPerFAT = static_cast<uint32_t>(((dataClusters + FIRST_DATA_CLUSTER)*4 + BYTES_PER_SECTOR-1) >> _bytesPerSectorShift);
+        _rootDirectorySectors = 0;
+        _totalSectors = static_cast<uint32_t>(SECTOR_DATA_REGION + (dataClusters << _sectorsPerClusterShift));
+    }else if (IS_EXFAT) {
+        /*
+            Sized for the clusters which are handed out (at least the exFAT minimum), the allocation bitmap lives behind the last file.
+            Its size depends on the cluster count it is part of, which settles after a round or two.
+         */
+        uint32_t dataClusters = 0;
+        uint32_t oldBitmapCluster = _bitmapCluster;
+        uint32_t oldBitmapClusters = _bitmapClusters;
+        _rootDirectoryClusters = clustersForSize(kRootDirectoryBytes);
+        _bitmapCluster = FIRST_FILE_CLUSTER;
+        if (_clusterHighWater > _bitmapCluster) _bitmapCluster = _clusterHighWater;
+        _bitmapClusters = 1;
+        while (true) {
+            uint32_t neededBitmapClusters = 0;
+            dataClusters = _bitmapCluster + _bitmapClusters - FIRST_DATA_CLUSTER;
+            if (dataClusters < kExFATMinClusters) dataClusters = kExFATMinClusters;
+            neededBitmapClusters = clustersForSize(((uint64_t)dataClusters+7)/8);
+            if (neededBitmapClusters <= _bitmapClusters) break;
+            _bitmapClusters = neededBitmapClusters;
+        }
+        //the bitmap entry lives in the root directory
+        if (_bitmapCluster != oldBitmapCluster || _bitmapClusters != oldBitmapClusters) invalidateDirectoryCache(kNoFile);
+
+        _reservedSectors = 2*kExFATBootRegionSectors;
+        _sectorsPerFAT = static_cast<uint32_t>((((uint64_t)dataClusters + FIRST_DATA_CLUSTER)*4 + BYTES_PER_SECTOR-1) >> _bytesPerSectorShift);
+        _rootDirectorySectors = 0;
+        _totalSectors = SECTOR_DATA_REGION + (dataClusters << _sectorsPerClusterShift);
+        _clusterLimit = FIRST_DATA_CLUSTER + (0xFFFFFFFFu - 2*kExFATBootRegionSectors - 1) / (SECTORS_PER_CLUSTER + 1);
+        if (_clusterLimit > EXFAT_CLUSTER_LIMIT) _clusterLimit = EXFAT_CLUSTER_LIMIT;
+    }else{
+        _rootDirectoryClusters = 0;
+        _reservedSectors = kReservedSectors;
+        _sectorsPerFAT = kFATBytes >> _bytesPerSectorShift;
+        _rootDirectorySectors = kRootDirectoryBytes >> _bytesPerSectorShift;
+        _totalSectors = ((FAT16_THRESHOLD*512) >> _bytesPerSectorShift) << _sectorsPerClusterShift;
+        _clusterLimit = FIRST_DATA_CLUSTER + ((_totalSectors - SECTOR_DATA_REGION) >> _sectorsPerClusterShift);
+        if (_clusterLimit > FAT16_CLUSTER_LIMIT) _clusterLimit = FAT16_CLUSTER_LIMIT;
+    }
+}
+
+int EmuFATFSBase::planLayout(){
+    int err = 0;
+    uint8_t shift = 0;
+    uint32_t nextCluster = 0;
+
+    /*
+        While files are being added they are provisionally laid out with the largest cluster size.
+        Pinned clusters (addFileDynamic with startCluster) can't be moved, so keep that layout then.
+     */
+    _layoutPending = false;
+    if (!_adaptiveClusterSize || _layoutFinalized) return placeDirectories();
+    _layoutFinalized = true;
+    cretassure(_nextFreeCluster, "Can't relayout files with fixed clusters");
+
+    _clusterHighWater = FIRST_DATA_CLUSTER;
+    for (; shift < kMaxSectorsPerClusterShift; shift++) {
+        uint64_t neededClusters = 0;
+        _sectorsPerClusterShift = shift;
+        updateGeometry();
+        neededClusters = FIRST_FILE_CLUSTER - FIRST_DATA_CLUSTER;
+        for (uint16_t i=0; i<_usedFiles; i++) {
+            const FileEntry *cfe = &_fileStorage[i];
+            if (!cfe->isDirectory && !cfe->isDynamicFile && !cfe->fileSize) continue;
+            neededClusters += clustersForSize(cfe->fileSize);
+        }
+        if (_volumeType != kVolumeTypeFAT16 && neededClusters > kMaxPlannedClusters) continue;
+        if (FIRST_DATA_CLUSTER + neededClusters <= _clusterLimit) break;
+    }
+    _sectorsPerClusterShift = shift;
+    updateGeometry();
+    nextCluster = FIRST_FILE_CLUSTER;
+    
+    for (uint16_t i=0; i<_usedFiles; i++) {
+        FileEntry *cfe = &_fileStorage[i];
+        cfe->clusterCount = clustersForSize(cfe->fileSize);
+        if (!cfe->isDirectory && !cfe->isDynamicFile && !cfe->fileSize) continue;
+        cfe->startCluster = nextCluster;
+        nextCluster += cfe->clusterCount;
+    }
+    _nextFreeCluster = nextCluster;
+    
+    rebuildClusterIndex();
+    updateGeometry();
+    invalidateDirectoryCaches();
+    
+error:
+    return -err;
+}
+
+int EmuFATFSBase::placeDirectories(){
+    int err = 0;
+    bool placedDirectory = false;
+
+    /*
+        Directories which are new or outgrew their clusters move behind the last file,
+        their old clusters are simply left unused
+     */
+    for (uint16_t i=0; i<_usedFiles; i++) {
+        FileEntry *cfe = &_fileStorage[i];
+        uint32_t neededClusters = 0;
+        if (!cfe->isDirectory) continue;
+        neededClusters = clustersForSize(cfe->fileSize);
+        if (cfe->startCluster && neededClusters <= cfe->clusterCount) continue;
+        cretassure(_nextFreeCluster, "Can't place directories next to files with fixed clusters");
+        cretassure((uint64_t)_nextFreeCluster + neededClusters <= _clusterLimit, "Not enough sectors left to store directory");
+        cfe->startCluster = _nextFreeCluster;
+        cfe->clusterCount = neededClusters;
+        _nextFreeCluster += neededClusters;
+        placedDirectory = true;
+    }
 
-    if (offset + size > SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR) size = SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR - didWrite - offset;
-    didWrite += size;
-    
 error:
-    if (err) {
-        return -err;
+    if (placedDirectory) {
+        rebuildClusterIndex();
+        updateGeometry();
+        invalidateDirectoryCaches();
     }
-    return didWrite;
-#undef MOVEOFFSET
-#undef DTINDEX
+    return -err;
 }
 
-//int32_t EmuFATFSBase::catchFileAllocationTableAccess(uint32_t offset, const void *buf, uint32_t size){
-//    int err = 0;
-//    int32_t didWrite = 0;
-//    const uint16_t *fe = (const uint16_t*)buf;
-//    uint16_t findex = offset/2;
-//
-//    cretassure((size & 1) == 0, "read size needs to be 2 bytes aligned!");
-//    cretassure((offset & 1) == 0, "offset needs to be 2 bytes aligned!");
-//    
-//#define MOVEFE do { fe++; size-=2; offset +=2; didWrite +=2; } while(0)
-//    if (size < sizeof(*fe))goto done;
-//    MOVEFE; //FAT16 type  (boot sector)
-//    if (size < sizeof(*fe))goto done;
-//
-//    while (size >= sizeof(*fe)*2){
-//        MOVEFE; //FAT16 type  (volume label) (on first iteration)
-//
-//        for (int i=0; i<_usedFiles; i++) {
-//            const FileEntry *cur = &_fileStorage[i];
-//            uint16_t usedClusters = (cur->fileSize/(BYTES_PER_SECTOR*SECTORS_PER_CLUSTER));
-//            
-//        }
-//
-//    }
-//    
-//    /*
-//     for (int i=0; i<_usedFiles; i++) {
-//         const FileEntry *cur = &_fileStorage[i];
-//         
-//         uint16_t usedClusters = (cur->fileSize/(BYTES_PER_SECTOR*SECTORS_PER_CLUSTER));
-//         if (cur->fileSize & ((BYTES_PER_SECTOR*SECTORS_PER_CLUSTER)-1)) usedClusters++;
-//         
-//         if (usedClusters) {
-//             for (int32_t z = 0; z<usedClusters-1; z++) {
-//                 if (size < sizeof(*fe)) goto error;
-//                 if (cur->startCluster + z != findex) continue;
-//                 *fe++ = ++findex; didRead+=2; size-=2;
-//             }
-//
-//             if (size < sizeof(*fe)) goto error;
-//             if (cur->startCluster + usedClusters-1 != findex) continue;
-//             *fe++ = 0xFFFF; didRead+=2; size-=2;
-//             findex++;
-//         }
-//     }
-//     
-//     if (offset + size > SECTORS_PER_FAT*BYTES_PER_SECTOR) size = SECTORS_PER_FAT*BYTES_PER_SECTOR - didRead - offset;
-//     memset(fe, 0, size); didRead += size;
-//     
-// error:
-//     if (err) {
-//         return -err;
-//     }
-//     return didRead;
-// #undef putentry
-//     */
-//done:
-//    MOVEFE;
-//error:
-//    if (err) {
-//        return -err;
-//    }
-//    return didWrite;
-//}
-
 #pragma mark public
 #pragma mark host accessors
-int32_t EmuFATFSBase::hostRead(uint32_t offset, void *buf, uint32_t size){
+int32_t EmuFATFSBase::hostRead(uint64_t offset, void *buf, uint32_t size){
+    finalize();
+    noteHostAccess(false, offset, size, NULL);
+    return readRegions(offset, buf, size);
+}
+
+int32_t EmuFATFSBase::readRegions(uint64_t offset, void *buf, uint32_t size){
     uint8_t *ptr = (uint8_t*)buf;
-    uint32_t sectorNum = offset / BYTES_PER_SECTOR;
-    int32_t didRead = 0;
+    uint32_t totalRead = 0;
     
-    if (sectorNum == SECTOR_BOOTSECTOR) {
-        didRead = readBootsector(offset, buf, size);
-        if (didRead > 0 && (didRead & (BYTES_PER_SECTOR-1)) == 0) return didRead;
-        
-    }else if (sectorNum >= SECTOR_FAT_1 && sectorNum < SECTOR_FAT_1 + SECTORS_PER_FAT) {
-        uint32_t sectionOffset = offset - SECTOR_FAT_1*BYTES_PER_SECTOR;
-
-        didRead = readFileAllocationTable(sectionOffset, buf, size);
-        if (didRead > 0 && (didRead & (BYTES_PER_SECTOR-1)) == 0) return didRead;
+    /*
+        Split the request at region boundaries, so that a single call can span
+        bootsector, both FATs, root directory and any number of files
+     */
+    while (size) {
+        uint64_t sectorNum = offset >> _bytesPerSectorShift;
+        uint32_t chunk = size;
+        int32_t didRead = 0;
+
+        if (sectorNum < SECTOR_FAT_1) {
+            if (offset + chunk > SECTOR_OFFSET(SECTOR_FAT_1)) chunk = static_cast<uint32_t>(SECTOR_OFFSET(SECTOR_FAT_1) - offset);
+            didRead = readBootsector(static_cast<uint32_t>(offset), ptr, chunk);
+
+        }else if (sectorNum < SECTOR_FAT_2) {
+            uint32_t sectionOffset = static_cast<uint32_t>(offset - SECTOR_OFFSET(SECTOR_FAT_1));
+            if (offset + chunk > SECTOR_OFFSET(SECTOR_FAT_2)) chunk = static_cast<uint32_t>(SECTOR_OFFSET(SECTOR_FAT_2) - offset);
+            didRead = readFileAllocationTable(sectionOffset, ptr, chunk);
+
+        }else if (sectorNum < SECTOR_ROOT_DIRECTORY) {
+            uint32_t sectionOffset = static_cast<uint32_t>(offset - SECTOR_OFFSET(SECTOR_FAT_2));
+            if (offset + chunk > SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY)) chunk = static_cast<uint32_t>(SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY) - offset);
+            didRead = readFileAllocationTable(sectionOffset, ptr, chunk);
+
+        }else if (sectorNum < SECTOR_DATA_REGION) {
+            uint32_t sectionOffset = static_cast<uint32_t>(offset - SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY));
+            if (offset + chunk > SECTOR_OFFSET(SECTOR_DATA_REGION)) chunk = static_cast<uint32_t>(SECTOR_OFFSET(SECTOR_DATA_REGION) - offset);
+            didRead = readRootDirectory(sectionOffset, ptr, chunk);
 
-    }else if (sectorNum >= SECTOR_FAT_2 && sectorNum < SECTOR_FAT_2 + SECTORS_PER_FAT) {
-        uint32_t sectionOffset = offset - SECTOR_FAT_2*BYTES_PER_SECTOR;
-
-        didRead = readFileAllocationTable(sectionOffset, buf, size);
-        if (didRead > 0 && (didRead & (BYTES_PER_SECTOR-1)) == 0) return didRead;
+        }else{
+            uint64_t sectionOffset = offset - SECTOR_OFFSET(SECTOR_DATA_REGION);
+            didRead = chunk = readDataRegion(sectionOffset, ptr, chunk);
+        }
 
-    }else if (sectorNum >= SECTOR_ROOT_DIRECTORY && sectorNum < SECTOR_DATA_REGION) {
-        uint32_t sectionOffset = offset - SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR;
+        if (didRead < 0) didRead = 0;
+        if (chunk > didRead) memset(&ptr[didRead], 0, chunk-didRead);
+        
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+        totalRead += chunk;
+    }
+    
+    return totalRead;
+}
 
-        didRead = readRootDirectory(sectionOffset, buf, size);
-        if (didRead > 0 && (didRead & (BYTES_PER_SECTOR-1)) == 0) return didRead;
-    }else if (sectorNum >= SECTOR_DATA_REGION) {
-        uint32_t sectionOffset = offset - SECTOR_DATA_REGION*BYTES_PER_SECTOR;
+int32_t EmuFATFSBase::hostReadRef(uint64_t offset, const void **outPtr, uint32_t size){
+    uint64_t sectorNum = 0;
+    uint64_t regionEnd = 0;
+    *outPtr = NULL;
 
-        uint32_t cluster = sectionOffset / BYTES_PER_CLUSTER;
+    finalize();
+    noteHostAccess(false, offset, size, NULL);
+    sectorNum = offset >> _bytesPerSectorShift;
+    
+    if (sectorNum < SECTOR_ROOT_DIRECTORY) {
+        //bootsector and FATs are generated on the fly and need to go through hostRead
+        if (sectorNum < SECTOR_FAT_1) regionEnd = SECTOR_OFFSET(SECTOR_FAT_1);
+        else if (sectorNum < SECTOR_FAT_2) regionEnd = SECTOR_OFFSET(SECTOR_FAT_2);
+        else regionEnd = SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY);
         
-        for (int i=0; i<_usedFiles; i++) {
-            const FileEntry *cfe = &_fileStorage[i];
-            uint32_t fileStartCluster = cfe->startCluster - FIRST_DATA_CLUSTER;
-            uint32_t fileClusterCnt = cfe->fileSize / BYTES_PER_CLUSTER;
-            if (cfe->fileSize & (BYTES_PER_CLUSTER-1)) fileClusterCnt++;
-            if (!fileClusterCnt) fileClusterCnt = 1;
-            if (cluster >= fileStartCluster && cluster < fileStartCluster + fileClusterCnt) {
-                uint32_t fileOffset = sectionOffset - fileStartCluster * BYTES_PER_CLUSTER;
-                if (fileOffset < cfe->fileSize){
-                  didRead = cfe->f_read(fileOffset, buf, size, cfe->filename);
-                }
-                break;
+    }else if (sectorNum < SECTOR_DATA_REGION || (_rootDirectoryClusters && offset - SECTOR_OFFSET(SECTOR_DATA_REGION) < ROOT_DIRECTORY_BYTES)) {
+        //FAT16 root directory region or the FAT32 root directory chain
+        uint64_t rootDirectoryOffset = sectorNum < SECTOR_DATA_REGION ? SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY) : SECTOR_OFFSET(SECTOR_DATA_REGION);
+        uint32_t sectionOffset = static_cast<uint32_t>(offset - rootDirectoryOffset);
+        uint32_t imageSize = 0;
+        
+        if (!_rootDirectoryCacheValid) buildRootDirectoryCache();
+        imageSize = _rootDirectoryEntries * sizeof(FAT_DirectoryTableEntry_t);
+        if (sectionOffset < imageSize) {
+            *outPtr = ((uint8_t*)_rootDirectoryCache)+sectionOffset;
+            regionEnd = offset + imageSize - sectionOffset;
+        }else{
+            regionEnd = rootDirectoryOffset + ROOT_DIRECTORY_BYTES;
+        }
+        
+    }else{
+        uint64_t sectionOffset = offset - SECTOR_OFFSET(SECTOR_DATA_REGION);
+        const FileEntry *cfe = NULL;
+        uint64_t chainOffset = 0;
+        
+        //host written chains always go through hostRead
+        if (_chainExtentsCnt && chainRegionChunk(sectionOffset, &size, &cfe, &chainOffset)) return size;
+        size = dataRegionChunk(sectionOffset, size, &cfe);
+        if (cfe && cfe->f_readRef && (uint16_t)(cfe - _fileStorage) != _writeBufferFile) {
+            uint64_t fileOffset = sectionOffset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+            if (fileOffset < cfe->fileSize) {
+                int32_t didRef = 0;
+                if (size > cfe->fileSize - fileOffset) size = static_cast<uint32_t>(cfe->fileSize - fileOffset);
+                uint64_t statsStart = statsTicks();
+                didRef = cfe->f_readRef(static_cast<uint32_t>(fileOffset), outPtr, size, cfe->filename);
+                if (STATS_ACTIVE) recordProviderCall(cfe, false, statsStart);
+                if (didRef > 0 && *outPtr) return didRef < size ? didRef : size;
+                *outPtr = NULL;
             }
         }
-
-        if (didRead < 0) didRead = 0;
-        if (size > BYTES_PER_SECTOR*SECTORS_PER_CLUSTER) size = BYTES_PER_CLUSTER;
-        if (size>=didRead) memset(&ptr[didRead], 0, size-didRead);
         return size;
     }
 
-    if (didRead < 0) didRead = 0;
-    if (size > BYTES_PER_SECTOR) size = BYTES_PER_SECTOR;
-    memset(&ptr[didRead], 0, size-didRead);
+    if (size > regionEnd - offset) size = static_cast<uint32_t>(regionEnd - offset);
     return size;
 }
 
-int32_t EmuFATFSBase::hostWrite(uint32_t offset, const void *buf, uint32_t size){
-    uint32_t sectorNum = offset / BYTES_PER_SECTOR;
+int32_t EmuFATFSBase::hostWrite(uint64_t offset, const void *buf, uint32_t size){
+    finalize();
+    noteHostAccess(true, offset, size, buf);
+    return writeRegions(offset, buf, size);
+}
+
+int32_t EmuFATFSBase::sharedWrite(uint64_t offset, const void *buf, uint32_t size){
+    uint64_t sectionOffset = 0;
+    uint64_t fileOffset = 0;
+    uint32_t chunk = size;
+    const FileEntry *cfe = NULL;
+    bool chained = false;
+
+    //buffering, caching and the synchronous wait for async providers keep per instance state
+    if (!_sharedReaders || _writeBuffer || _readAheadSlots || _readCacheBlocks) return 0;
+    if ((offset >> _bytesPerSectorShift) < SECTOR_DATA_REGION) return 0;
+    sectionOffset = offset - SECTOR_OFFSET(SECTOR_DATA_REGION);
+    if (sectionOffset < ROOT_DIRECTORY_BYTES && _rootDirectoryClusters) return 0;
+
+    chained = _chainExtentsCnt && chainRegionChunk(sectionOffset, &chunk, &cfe, &fileOffset) && cfe;
+    if (!chained) {
+        //like writeRegions, the whole write goes to the file owning its first cluster
+        chunk = size;
+        cfe = getFileForCluster(static_cast<uint32_t>(sectionOffset >> CLUSTER_SHIFT) + FIRST_DATA_CLUSTER);
+        //a dynamic file may claim the cluster, that's an update (exFAT: up-case table, bitmap and directories fail there)
+        if (!cfe || (IS_EXFAT && cfe->isDirectory)) return 0;
+        fileOffset = sectionOffset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+    }
+    if (cfe->f_writeAsync) return 0;
+
+    noteHostAccess(true, offset, chunk, buf);
+    if (isWritable(cfe) && fileOffset < cfe->fileSize) {
+        uint32_t writeSize = chunk;
+        //host written chains are cut at the end of the file, like in writeRegions
+        if (chained && cfe->fileSize - fileOffset < writeSize) writeSize = static_cast<uint32_t>(cfe->fileSize - fileOffset);
+        fileWriteThrough(cfe, fileOffset, buf, writeSize);
+    }
+    return chunk;
+}
+
+int32_t EmuFATFSBase::writeRegions(uint64_t offset, const void *buf, uint32_t size){
+    int err = 0;
+    uint64_t sectorNum = offset >> _bytesPerSectorShift;
     int32_t didWrite = 0;
     
+    if (IS_EXFAT) {
+        //entry sets and the allocation bitmap aren't parsed, so only data of files we know can be written
+        const FileEntry *owner = NULL;
+        if (sectorNum >= SECTOR_DATA_REGION) owner = getFileForCluster(static_cast<uint32_t>((offset - SECTOR_OFFSET(SECTOR_DATA_REGION)) >> CLUSTER_SHIFT) + FIRST_DATA_CLUSTER);
+        cretassure(owner && !owner->isDirectory, "exFAT volumes are write protected");
+    }
     if (sectorNum >= SECTOR_ROOT_DIRECTORY && sectorNum < SECTOR_DATA_REGION) {
-        uint32_t sectionOffset = offset - SECTOR_ROOT_DIRECTORY*BYTES_PER_SECTOR;
+        uint32_t sectionOffset = static_cast<uint32_t>(offset - SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY));
 
         return catchRootDirectoryAccess(sectionOffset, buf, size);
         
+    }else if (sectorNum >= SECTOR_FAT_1 && sectorNum < SECTOR_ROOT_DIRECTORY) {
+        //both copies are tracked the same, a write crossing into the second one continues at its start
+        uint64_t fatBytes = SECTOR_OFFSET(SECTORS_PER_FAT);
+        uint64_t sectionOffset = offset - SECTOR_OFFSET(SECTOR_FAT_1);
+        uint32_t chunk = size;
+        if (sectionOffset >= fatBytes) sectionOffset -= fatBytes;
+        if (sectionOffset + chunk > fatBytes) chunk = static_cast<uint32_t>(fatBytes - sectionOffset);
+        //out of chain extents, the chain isn't known and data written to it would end up elsewhere
+        if ((didWrite = catchFileAllocationTableAccess(static_cast<uint32_t>(sectionOffset), buf, chunk)) < 0) return didWrite;
+        if (chunk < size && (didWrite = writeRegions(offset + chunk, (const uint8_t*)buf + chunk, size - chunk)) < 0) return didWrite;
+        return size;
+
     }else if (sectorNum >= SECTOR_DATA_REGION) {
-        uint32_t sectionOffset = offset - SECTOR_DATA_REGION*BYTES_PER_SECTOR;
+        uint64_t sectionOffset = offset - SECTOR_OFFSET(SECTOR_DATA_REGION);
+
+        if (sectionOffset < ROOT_DIRECTORY_BYTES && _rootDirectoryClusters) {
+            return catchRootDirectoryAccess(static_cast<uint32_t>(sectionOffset), buf, size);
+        }
 
-        uint32_t cluster = sectionOffset / BYTES_PER_CLUSTER;
+        uint32_t cluster = static_cast<uint32_t>(sectionOffset >> CLUSTER_SHIFT);
+        {
+            const FileEntry *chained = NULL;
+            uint64_t fileOffset = 0;
+            uint32_t chunk = size;
+            if (_chainExtentsCnt && chainRegionChunk(sectionOffset, &chunk, &chained, &fileOffset) && chained) {
+                if (isWritable(chained) && fileOffset < chained->fileSize) {
+                    didWrite = fileWrite(chained, fileOffset, buf, chained->fileSize - fileOffset < chunk ? static_cast<uint32_t>(chained->fileSize - fileOffset) : chunk);
+                }
+                if (didWrite < 0) return didWrite;
+                if (chunk < size && (didWrite = writeRegions(offset + chunk, (const uint8_t*)buf + chunk, size - chunk)) < 0) return didWrite;
+                return size;
+            }
+        }
+        FileEntry *cfe = getFileForCluster(cluster + FIRST_DATA_CLUSTER);
         
-        for (int i=0; i<_usedFiles; i++) {
-            FileEntry *cfe = &_fileStorage[i];
-            if (!cfe->f_write) continue;
-
-            if (cfe->isDynamicFile && cfe->startCluster == 0){
-              /*
-                Best we can do is to guess the target cluster :(
-              */
-              cfe->startCluster = cluster + FIRST_DATA_CLUSTER;
+        if (!cfe) {
+            for (uint16_t i=0; i<_usedFiles; i++) {
+                FileEntry *dfe = &_fileStorage[i];
+                if (dfe->isDynamicFile && dfe->startCluster == 0 && isWritable(dfe)){
+                  /*
+                    Best we can do is to guess the target cluster :(
+                  */
+                  dfe->startCluster = cluster + FIRST_DATA_CLUSTER;
+                  indexFile(i);
+                  invalidateDirectoryCaches();
+                  _chainsDirty = true;
+                  cfe = dfe;
+                  break;
+                }
             }
-            
-            uint32_t fileStartCluster = cfe->startCluster - FIRST_DATA_CLUSTER;
-            uint32_t fileClusterCnt = cfe->fileSize / BYTES_PER_CLUSTER;
-            if (cfe->fileSize & (BYTES_PER_CLUSTER-1)) fileClusterCnt++;
-            if (!fileClusterCnt) fileClusterCnt = 1;
-            if (cluster >= fileStartCluster && cluster < fileStartCluster + fileClusterCnt) {
-                uint32_t fileOffset = sectionOffset - fileStartCluster * BYTES_PER_CLUSTER;
-                if (fileOffset < cfe->fileSize){
-                  didWrite = cfe->f_write(fileOffset, buf, size, cfe->filename);
-                }              
-                break;
+        }
+        
+        if (cfe && isWritable(cfe)) {
+            uint64_t fileOffset = sectionOffset - ((uint64_t)(cfe->startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT);
+            if (fileOffset < cfe->fileSize){
+              didWrite = fileWrite(cfe, fileOffset, buf, size);
             }
         }
     }
 
+    //pending buffered data which couldn't be written out
+    if (didWrite < 0) return didWrite;
+    
+error:
+    if (err) {
+        return -err;
+    }
     return size;
 }
 
+int EmuFATFSBase::registerRequestQueue(HostRequest *storage, uint16_t depth){
+    int err = 0;
+    
+    cretassure(!_requestCount, "Requests are still in flight");
+    if (storage) {
+        cretassure(depth && depth < kSyncProviderToken, "Invalid queue depth");
+        for (uint16_t i=0; i<depth; i++) storage[i].state.store(kHostRequestFree, std::memory_order_relaxed);
+    }
+    _requests = storage;
+    _requestDepth = storage ? depth : 0;
+    _requestNext = 0;
+    
+error:
+    return -err;
+}
+
+int EmuFATFSBase::submitRead(uint64_t offset, void *buf, uint32_t size, cb_hostComplete cb, void *ctx){
+    return submitRequest(false, offset, buf, size, cb, ctx);
+}
+
+int EmuFATFSBase::submitWrite(uint64_t offset, const void *buf, uint32_t size, cb_hostComplete cb, void *ctx){
+    //the buffer is only ever read for writes
+    return submitRequest(true, offset, (void*)buf, size, cb, ctx);
+}
+
+int EmuFATFSBase::poll(){
+    int inFlight = 0;
+    int failed = 0;
+    uint16_t start = _requestNext;
+    
+    finalize();
+    /*
+        Oldest slots first: the ones behind the allocation cursor were handed out longest ago.
+        Completion callbacks may submit the next request, unless it lands in an already visited slot it's picked up in the same pass.
+     */
+    for (uint16_t i=0; i<_requestDepth && _requestCount; i++) {
+        int r = advanceRequest((uint16_t)((start + i) % _requestDepth));
+        if (r < 0) {
+            if (!failed) failed = r;
+        }else{
+            inFlight += r;
+        }
+    }
+    return failed ? failed : inFlight;
+}
+
+void EmuFATFSBase::completeProviderIO(uint16_t token, int32_t result){
+    HostRequest *req = NULL;
+    
+    if (token == kSyncProviderToken) req = &_syncRequest;
+    else if (token < _requestDepth) req = &_requests[token];
+    else return;
+    //synchronous waits are timed by the caller
+    if (req != &_syncRequest) {
+        if (req->isWrite) STATS_LATENCY(providerWrite, req->providerStart);
+        else STATS_LATENCY(providerRead, req->providerStart);
+    }
+    req->providerResult = result;
+    req->state.store(kHostRequestProviderDone, std::memory_order_release);
+}
+
+int EmuFATFSBase::queryExtents(uint64_t offset, uint64_t length, DiskExtent *extents, uint16_t maxExtents){
+    uint64_t end = 0;
+    uint16_t cnt = 0;
+    
+    finalize();
+    end = SECTOR_OFFSET(TOTAL_SECTORS);
+    if (offset >= end) return 0;
+    if (length < end - offset) end = offset + length;
+    
+    while (offset < end) {
+        ExtentType type = kExtentData;
+        uint64_t extentEnd = extentAt(offset, &type);
+        if (extentEnd > end) extentEnd = end;
+        if (cnt && extents[cnt-1].type == type && extents[cnt-1].offset + extents[cnt-1].length == offset) {
+            extents[cnt-1].length += extentEnd - offset;
+        }else{
+            if (cnt == maxExtents) break;
+            extents[cnt++] = {offset, extentEnd - offset, type};
+        }
+        offset = extentEnd;
+    }
+    return cnt;
+}
+
 uint32_t EmuFATFSBase::diskBlockNum(){
+    finalize();
     return TOTAL_SECTORS;
 }
 
+bool EmuFATFSBase::isWriteProtected(){
+    return IS_EXFAT;
+}
+
 uint32_t EmuFATFSBase::diskBlockSize(){
     return BYTES_PER_SECTOR;
 }
 
 uint32_t EmuFATFSBase::bytesPerCluster(){
+    finalize();
     return BYTES_PER_CLUSTER;
 }
 
+void EmuFATFSBase::setVolumeSize(uint64_t volumeBytes){
+    _volumeBytes = volumeBytes;
+    updateGeometry();
+}
+
 
 #pragma mark emu providers
 void EmuFATFSBase::resetFiles(){
+    //whatever can't be written out belongs to files which are gone
+    flush();
+    _writeBufferFile = kNoFile;
+    if (_readAheadSlots) invalidateReadAhead(kNoFile, 0, 0);
+    if (_readCacheBlocks) invalidateReadCache();
     _usedFiles = 0;
+    _clusterIndexCnt = 0;
+    _rootDirectoryEntries = ROOT_DIRECTORY_FIXED_ENTRIES;
+    _rootFirstChild = _rootLastChild = kNoFile;
+    memset(_nameBuckets, 0xFF, _nameBucketCount*sizeof(*_nameBuckets)); //kNoFile
+    _lastDirectory = kNoFile;
+    _chainExtentsCnt = 0;
+    _chainsDirty = false;
+    invalidateDirectoryCaches();
     _usedFilenamesBytes = 0;
-    _nextFreeCluster = FIRST_DATA_CLUSTER;
+    _clusterHighWater = FIRST_DATA_CLUSTER;
+    if (_adaptiveClusterSize) {
+        _sectorsPerClusterShift = kMaxSectorsPerClusterShift;
+        _layoutFinalized = false;
+    }
+    _layoutPending = false;
+    updateGeometry();
+    _nextFreeCluster = FIRST_FILE_CLUSTER;
+    noteFileSetChanged();
 }
 
-int EmuFATFSBase::addFile(const char *filename, const char *filenameSuffix, uint32_t fileSize, cb_read f_read, cb_write f_write){
+int EmuFATFSBase::copyStateFrom(const EmuFATFSBase &src){
+    int err = 0;
+    
+    cretassure(_maxFileStorageEntires == src._maxFileStorageEntires && _filenamesBufSize == src._filenamesBufSize
+               && _rootDirectoryCacheSize == src._rootDirectoryCacheSize && _maxChainExtents == src._maxChainExtents
+               && _rootShadowSlots == src._rootShadowSlots && _nameBucketCount == src._nameBucketCount
+               && _volumeType == src._volumeType, "Snapshots need the same configuration");
+    
+    //cached blocks belong to the old file table
+    if (_readCacheBlocks) invalidateReadCache();
+    memcpy(_fileStorage, src._fileStorage, src._usedFiles*sizeof(FileEntry));
+    for (uint16_t i=0; i<src._usedFiles; i++) {
+        //filenames live in the filename buffer of their instance
+        _fileStorage[i].filename = _filenamesBuf + (src._fileStorage[i].filename - src._filenamesBuf);
+    }
+    memcpy(_clusterIndex, src._clusterIndex, src._clusterIndexCnt*sizeof(*_clusterIndex));
+    memcpy(_filenamesBuf, src._filenamesBuf, src._usedFilenamesBytes);
+    //an outdated image is still what the shadow was taken from
+    memcpy(_rootDirectoryCache, src._rootDirectoryCache, src._rootShadowGenerated*sizeof(FAT_DirectoryTableEntry_t));
+    memcpy(_chainExtents, src._chainExtents, src._chainExtentsCnt*sizeof(ChainExtent));
+    memcpy(_rootShadow, src._rootShadow, _rootShadowSlots*sizeof(*_rootShadow));
+    memcpy(_nameBuckets, src._nameBuckets, _nameBucketCount*sizeof(*_nameBuckets));
+    
+    _usedFiles = src._usedFiles;
+    _clusterIndexCnt = src._clusterIndexCnt;
+    _rootDirectoryEntries = src._rootDirectoryEntries;
+    _rootDirectoryCacheValid = src._rootDirectoryCacheValid;
+    _rootFirstChild = src._rootFirstChild;
+    _rootLastChild = src._rootLastChild;
+    _rootShadowGenerated = src._rootShadowGenerated;
+    _directoryCacheOwner = kNoFile;
+    _lastDirectory = src._lastDirectory;
+    _chainExtentsCnt = src._chainExtentsCnt;
+    _chainsDirty = src._chainsDirty;
+    _usedFilenamesBytes = src._usedFilenamesBytes;
+    _bytesPerSectorShift = src._bytesPerSectorShift;
+    _sectorsPerClusterShift = src._sectorsPerClusterShift;
+    _reservedSectors = src._reservedSectors;
+    _sectorsPerFAT = src._sectorsPerFAT;
+    _rootDirectorySectors = src._rootDirectorySectors;
+    _rootDirectoryClusters = src._rootDirectoryClusters;
+    _totalSectors = src._totalSectors;
+    _clusterLimit = src._clusterLimit;
+    _clusterHighWater = src._clusterHighWater;
+    _volumeBytes = src._volumeBytes;
+    _bitmapCluster = src._bitmapCluster;
+    _bitmapClusters = src._bitmapClusters;
+    _adaptiveClusterSize = src._adaptiveClusterSize;
+    _layoutPending = src._layoutPending;
+    _layoutFinalized = src._layoutFinalized;
+    //the copy is private until prepareSharedReads(), so it may use its own caches
+    _sharedReaders = false;
+    _generation = src._generation;
+    memcpy(_volumeLabel, src._volumeLabel, sizeof(_volumeLabel));
+    _nextFreeCluster = src._nextFreeCluster;
+    _newfilecb = src._newfilecb;
+    _newfilecbCtx = src._newfilecbCtx;
+    _newfilecbCtxArg = src._newfilecbCtxArg;
+    
+error:
+    return -err;
+}
+
+void EmuFATFSBase::noteFileSetChanged(){
+    if (_inNewfileCallback) return;
+    if (_updateDepth) _updateChanged = true;
+    else _generation++;
+}
+
+void EmuFATFSBase::beginUpdate(){
+    //pending data belongs to the old file set
+    if (!_updateDepth) flush();
+    _updateDepth++;
+}
+
+int EmuFATFSBase::commitUpdate(){
+    int err = 0;
+    
+    cretassure(_updateDepth, "No update in progress");
+    if (--_updateDepth) return 0;
+    if (_updateChanged) {
+        _updateChanged = false;
+        _generation++;
+    }
+    cretassure(!finalize(), "Failed to finalize layout");
+    if (!_rootDirectoryCacheValid) buildRootDirectoryCache();
+    
+error:
+    return -err;
+}
+
+bool EmuFATFSBase::mediumChanged(uint32_t *seenGeneration){
+    if (*seenGeneration == _generation) return false;
+    *seenGeneration = _generation;
+    return true;
+}
+
+void EmuFATFSBase::prepareSharedReads(){
+    finalize();
+    if (!_rootDirectoryCacheValid) buildRootDirectoryCache();
+    _directoryCacheOwner = kNoFile;
+    _sharedReaders = true;
+}
+
+bool EmuFATFSBase::nameMatches(const FileEntry *cfe, const char *name, size_t nameLen){
+    if (cfe->filenameLenNoSuffix != nameLen) return false;
+    for (size_t i=0; i<nameLen; i++) {
+        char c = name[i];
+        if (strchr(gBadFilenameChars, c)) c = '_';
+        if (cfe->filename[i] != c) return false;
+    }
+    return true;
+}
+
+bool EmuFATFSBase::isDirectoryPath(uint16_t dirIdx, const char *path, size_t pathLen){
+    //walk up from dirIdx while consuming path components from the back
+    while (true) {
+        size_t start = 0;
+        while (pathLen && path[pathLen-1] == '/') pathLen--;
+        if (!pathLen) return dirIdx == kNoFile;
+        if (dirIdx == kNoFile) return false;
+        for (start = pathLen; start && path[start-1] != '/'; start--);
+        if (!nameMatches(&_fileStorage[dirIdx], &path[start], pathLen-start)) return false;
+        dirIdx = _fileStorage[dirIdx].parent;
+        pathLen = start;
+    }
+}
+
+uint16_t EmuFATFSBase::findDirectory(uint16_t parent, const char *name, size_t nameLen){
+    uint16_t i = parent == kNoFile ? _rootFirstChild : _fileStorage[parent].firstChild;
+    for (; i != kNoFile; i = _fileStorage[i].nextSibling) {
+        const FileEntry *cfe = &_fileStorage[i];
+        if (cfe->isDirectory && nameMatches(cfe, name, nameLen)) break;
+    }
+    return i;
+}
+
+int EmuFATFSBase::resolveDirectory(const char *path, uint16_t *outDirectory, const char **outName){
     int err = 0;
+    uint16_t dir = kNoFile;
+    const char *name = strrchr(path, '/');
+    name = name ? name+1 : path;
+
+    /*
+        Files usually come grouped by directory, so check the directory of the previous file first
+     */
+    if (isDirectoryPath(_lastDirectory, path, name - path)) {
+        dir = _lastDirectory;
+    }else{
+        for (const char *sep = NULL; (sep = strchr(path, '/')); path = sep+1) {
+            uint16_t child = kNoFile;
+            if (sep == path) continue;
+            child = findDirectory(dir, path, sep - path);
+            if (child == kNoFile) {
+                cretassure(!addDirectoryEntry(path, sep - path, dir), "Failed to create directory");
+                child = _usedFiles-1;
+            }
+            dir = child;
+        }
+        _lastDirectory = dir;
+    }
+    *outDirectory = dir;
+    *outName = name;
     
+error:
+    return -err;
+}
+
+char *EmuFATFSBase::storeFilename(const char *name, size_t nameLen, const char *filenameSuffix, size_t *outNeededBytes){
     char *fnameDst = &_filenamesBuf[_usedFilenamesBytes];
     size_t fnameSize = _filenamesBufSize-_usedFilenamesBytes;
-    size_t neededNameBytes = strlen(filename) + 1 + 3;
-
-    cretassure(neededNameBytes <= fnameSize, "Not enough space to add filename");
-    cretassure(_usedFiles < _maxFileStorageEntires, "Not enough file entries left");
-    cretassure(f_read, "No read function provided");
-    cretassure(_nextFreeCluster, "nextFreeCluster shouldn't be zero!");
+    size_t neededNameBytes = nameLen + 1 + 3;
 
-    snprintf(fnameDst, neededNameBytes+1, "%s%c%s%s", filename, '\0', filenameSuffix ? filenameSuffix : "", "   ");
+    if (neededNameBytes > fnameSize) return NULL;
+    snprintf(fnameDst, neededNameBytes+1, "%.*s%c%s%s", (int)nameLen, name, '\0', filenameSuffix ? filenameSuffix : "", "   ");
 
     for (int i=0; i<neededNameBytes-4; i++) {
-        const char *bad_chars = "*?<>|\"\\/:";
-        if (strchr(bad_chars, fnameDst[i])){
+        if (strchr(gBadFilenameChars, fnameDst[i])){
             fnameDst[i] = '_';
         }
     }
+    *outNeededBytes = neededNameBytes;
+    return fnameDst;
+}
+
+int EmuFATFSBase::linkEntry(uint16_t fileIdx, uint16_t parent){
+    int err = 0;
+    FileEntry *cfe = &_fileStorage[fileIdx];
+    uint16_t neededDirEntries = directoryEntriesForFile(cfe);
+    uint16_t *lastChild = NULL;
+
+    if (parent == kNoFile) {
+        cretassure(_rootDirectoryEntries + neededDirEntries <= _rootDirectoryCacheSize, "Not enough root directory entries left");
+        _rootDirectoryEntries += neededDirEntries;
+        if (_rootLastChild == kNoFile) _rootFirstChild = fileIdx;
+        lastChild = &_rootLastChild;
+    }else{
+        FileEntry *dir = &_fileStorage[parent];
+        cretassure(dir->fileSize + neededDirEntries*sizeof(FAT_DirectoryTableEntry_t) <= kMaxDirectoryBytes, "Not enough directory entries left");
+        dir->fileSize += neededDirEntries*sizeof(FAT_DirectoryTableEntry_t);
+        if (!dir->startCluster || clustersForSize(dir->fileSize) > dir->clusterCount) _layoutPending = true;
+        if (dir->lastChild == kNoFile) dir->firstChild = fileIdx;
+        lastChild = &dir->lastChild;
+    }
+    if (*lastChild != kNoFile) _fileStorage[*lastChild].nextSibling = fileIdx;
+    *lastChild = fileIdx;
+    cfe->parent = parent;
+    cfe->nextSibling = kNoFile;
+    if (parent == kNoFile && !IS_EXFAT) indexShortName(fileIdx);
+    //only the parent's image changes, moved directories invalidate everything in placeDirectories()
+    invalidateDirectoryCache(parent);
+
+error:
+    return -err;
+}
+
+int EmuFATFSBase::addDirectoryEntry(const char *name, size_t nameLen, uint16_t parent){
+    int err = 0;
+    size_t neededNameBytes = 0;
+    char *fnameDst = NULL;
+    FileEntry *cfe = NULL;
+
+    cretassure(_usedFiles < _maxFileStorageEntires, "Not enough file entries left");
+    cretassure(fnameDst = storeFilename(name, nameLen, NULL, &neededNameBytes), "Not enough space to add filename");
+
+    cfe = &_fileStorage[_usedFiles];
+    *cfe = {};
+    cfe->filename = fnameDst;
+    cfe->filenameLenNoSuffix = (uint32_t)nameLen;
+    cfe->fileSize = IS_EXFAT ? 0 : 2*sizeof(FAT_DirectoryTableEntry_t); //"." and ".."
+    cfe->isDirectory = true;
+    cfe->firstChild = cfe->lastChild = kNoFile;
+    cretassure(longFilenameLength(cfe) <= 255, "Filename too long");
+    cretassure(!linkEntry(_usedFiles, parent), "Failed to link directory");
+
+    //clusters are handed out by placeDirectories() once the directory size is known
+    _usedFiles++;
+    _usedFilenamesBytes += neededNameBytes;
+    _layoutPending = true;
+    noteFileSetChanged();
+
+error:
+    return -err;
+}
+
+int EmuFATFSBase::addFileEntry(const char *filename, const char *filenameSuffix, uint64_t fileSize, uint32_t startCluster, bool isDynamicFile, const FileEntry &providers){
+    int err = 0;
+    uint16_t parent = kNoFile;
+    size_t neededNameBytes = 0;
+    char *fnameDst = NULL;
+
+    cretassure(providers.f_read || providers.f_readRef || providers.f_readCtx || providers.f_readAsync, "No read function provided");
+    cretassure(isDynamicFile || _nextFreeCluster, "nextFreeCluster shouldn't be zero!");
+    cretassure(IS_EXFAT || fileSize <= 0xFFFFFFFF, "Files larger than 4GiB need exFAT");
+    cretassure((fileSize >> CLUSTER_SHIFT) < _clusterLimit, "File too large for the volume");
+    cretassure(!resolveDirectory(filename, &parent, &filename), "Failed to resolve directory");
+    cretassure(_usedFiles < _maxFileStorageEntires, "Not enough file entries left");
+    cretassure(fnameDst = storeFilename(filename, strlen(filename), filenameSuffix, &neededNameBytes), "Not enough space to add filename");
     
     {
         FileEntry *cfe = &_fileStorage[_usedFiles];
-        cfe->f_read = f_read;
-        cfe->f_write = f_write;
+        bool allocateClusters = isDynamicFile ? !startCluster : fileSize != 0;
+        *cfe = providers;
         cfe->filename = fnameDst;
         cfe->filenameLenNoSuffix = (uint32_t)strlen(fnameDst);
         cfe->fileSize = fileSize;
-        cfe->startCluster = _nextFreeCluster;
-        cfe->isDynamicFile = false;
+        cfe->startCluster = startCluster ? startCluster : _nextFreeCluster;
+        cfe->clusterCount = clustersForSize(fileSize);
+        cfe->isDynamicFile = isDynamicFile;
 
-        if (fileSize){
-          uint32_t neededClusters = fileSize / BYTES_PER_CLUSTER;
-          if (fileSize & (BYTES_PER_CLUSTER -1)) neededClusters++;
-
-          if (!neededClusters) neededClusters = 1;
-
-          cretassure(cfe->startCluster + neededClusters < 0x10000, "Not enough sectors left to store file");
-          
-          _nextFreeCluster += neededClusters;
-        }else{
+        if (allocateClusters){
+          cretassure((uint64_t)cfe->startCluster + cfe->clusterCount <= _clusterLimit, "Not enough sectors left to store file");
+        }else if (!isDynamicFile){
           cfe->startCluster = 0;
-        }    
+        }
+        cretassure(longFilenameLength(cfe) <= 255, "Filename too long");
+        cretassure(!linkEntry(_usedFiles, parent), "Not enough directory entries left");
+
+        if (allocateClusters){
+          _nextFreeCluster += cfe->clusterCount;
+        }else if (isDynamicFile){
+          _nextFreeCluster = 0; //disable adding files statically
+        }
     }
     
+    indexFile(_usedFiles);
     _usedFiles++;
     _usedFilenamesBytes += neededNameBytes;
+    noteFileSetChanged();
+    if (_adaptiveClusterSize && !_layoutFinalized) _layoutPending = true;
+    if (_volumeType != kVolumeTypeFAT16) updateGeometry();
     
 error:
     return -err;
 }
 
+int EmuFATFSBase::addDirectory(const char *path){
+    int err = 0;
+    uint16_t parent = kNoFile;
+    const char *name = NULL;
+
+    cretassure(!resolveDirectory(path, &parent, &name), "Failed to resolve directory");
+    if (*name && findDirectory(parent, name, strlen(name)) == kNoFile) {
+        cretassure(!addDirectoryEntry(name, strlen(name), parent), "Failed to create directory");
+    }
+
+error:
+    return -err;
+}
+
+int EmuFATFSBase::addFile(const char *filename, const char *filenameSuffix, uint32_t fileSize, cb_read f_read, cb_write f_write){
+    FileEntry providers = {};
+    providers.f_read = f_read;
+    providers.f_write = f_write;
+    return addFileEntry(filename, filenameSuffix, fileSize, 0, false, providers);
+}
+
+int EmuFATFSBase::addFile(const char *filename, const char *filenameSuffix, uint64_t fileSize, cb_readCtx f_read, cb_writeCtx f_write, void *ctx){
+    FileEntry providers = {};
+    providers.f_readCtx = f_read;
+    providers.f_writeCtx = f_write;
+    providers.ctx = ctx;
+    return addFileEntry(filename, filenameSuffix, fileSize, 0, false, providers);
+}
+
+int EmuFATFSBase::addFileAsync(const char *filename, const char *filenameSuffix, uint64_t fileSize, cb_readAsync f_read, cb_writeAsync f_write, void *ctx){
+    FileEntry providers = {};
+    providers.f_readAsync = f_read;
+    providers.f_writeAsync = f_write;
+    providers.ctx = ctx;
+    return addFileEntry(filename, filenameSuffix, fileSize, 0, false, providers);
+}
+
+int EmuFATFSBase::addFileRef(const char *filename, const char *filenameSuffix, uint32_t fileSize, cb_readRef f_readRef, cb_write f_write){
+    FileEntry providers = {};
+    providers.f_readRef = f_readRef;
+    providers.f_write = f_write;
+    return addFileEntry(filename, filenameSuffix, fileSize, 0, false, providers);
+}
+
 int EmuFATFSBase::addFileDynamic(const char *filename, const char *filenameSuffix, uint32_t fileSize, uint32_t startCluster, cb_read f_read, cb_write f_write){
+    FileEntry providers = {};
+    providers.f_read = f_read;
+    providers.f_write = f_write;
+    return addFileEntry(filename, filenameSuffix, fileSize, startCluster, true, providers);
+}
+
+int EmuFATFSBase::addFileDynamic(const char *filename, const char *filenameSuffix, uint64_t fileSize, uint32_t startCluster, cb_readCtx f_read, cb_writeCtx f_write, void *ctx){
+    FileEntry providers = {};
+    providers.f_readCtx = f_read;
+    providers.f_writeCtx = f_write;
+    providers.ctx = ctx;
+    return addFileEntry(filename, filenameSuffix, fileSize, startCluster, true, providers);
+}
+
+
+void EmuFATFSBase::registerNewfileCallback(cb_newFile f_newfilecb){
+    _newfilecb = f_newfilecb;
+}
+
+void EmuFATFSBase::registerNewfileCallback(cb_newFileCtx f_newfilecb, void *ctx){
+    _newfilecbCtx = f_newfilecb;
+    _newfilecbCtxArg = ctx;
+}
+
+int EmuFATFSBase::registerWriteBuffer(void *buf, uint32_t size, uint32_t blockSize){
     int err = 0;
     
-    char *fnameDst = &_filenamesBuf[_usedFilenamesBytes];
-    size_t fnameSize = _filenamesBufSize-_usedFilenamesBytes;
-    size_t neededNameBytes = strlen(filename) + 1 + 3;
+    cretassure(!flush(), "Failed to flush pending writes");
+    if (buf) {
+        cretassure(blockSize && (blockSize & (blockSize-1)) == 0, "blockSize needs to be a power of two");
+        cretassure(size >= blockSize && (size & (blockSize-1)) == 0, "size needs to be a multiple of blockSize");
+    }
+    _writeBuffer = (uint8_t*)buf;
+    _writeBufferSize = buf ? size : 0;
+    _writeBlockSize = buf ? blockSize : 0;
+    
+error:
+    return -err;
+}
 
-    cretassure(neededNameBytes <= fnameSize, "Not enough space to add filename");
-    cretassure(_usedFiles < _maxFileStorageEntires, "Not enough file entries left");
-    cretassure(f_read, "No read function provided");
+int EmuFATFSBase::registerReadAhead(ReadAheadSlot *slots, uint16_t slotCount, void *pool, uint32_t slotSize){
+    int err = 0;
+    
+    if (slots) {
+        cretassure(slotCount && pool, "Need at least one slot and a pool");
+        cretassure(slotSize && (slotSize & (slotSize-1)) == 0, "slotSize needs to be a power of two");
+        for (uint16_t i=0; i<slotCount; i++) {
+            slots[i].state.store(kReadAheadFree, std::memory_order_relaxed);
+            slots[i].stale = false;
+            slots[i].fileIdx = kNoFile;
+            slots[i].length = 0;
+            slots[i].offset = 0;
+            slots[i].data = (uint8_t*)pool + (size_t)i * slotSize;
+        }
+    }
+    _readAheadSlots = slots;
+    _readAheadSlotCount = slots ? slotCount : 0;
+    _readAheadSlotSize = slots ? slotSize : 0;
+    
+error:
+    return -err;
+}
 
-    snprintf(fnameDst, neededNameBytes+1, "%s%c%s%s", filename, '\0', filenameSuffix ? filenameSuffix : "", "   ");
+int EmuFATFSBase::prefetch(){
+    for (uint16_t i=0; i<_readAheadSlotCount; i++) {
+        ReadAheadSlot *slot = &_readAheadSlots[i];
+        const FileEntry *cfe = NULL;
+        uint32_t didLoad = 0;
+        if (slot->state.load(std::memory_order_acquire) != kReadAheadPending) continue;
+        slot->state.store(kReadAheadLoading, std::memory_order_relaxed);
+        cfe = &_fileStorage[slot->fileIdx];
+        while (didLoad < slot->length) {
+            int32_t r = fileReadThrough(cfe, slot->offset + didLoad, &slot->data[didLoad], slot->length - didLoad);
+            if (r <= 0) break;
+            didLoad += r;
+        }
+        slot->state.store(didLoad == slot->length ? kReadAheadValid : kReadAheadFree, std::memory_order_release);
+        return 1;
+    }
+    return 0;
+}
 
-    for (int i=0; i<neededNameBytes-4; i++) {
-        const char *bad_chars = "*?<>|\"\\/:";
-        if (strchr(bad_chars, fnameDst[i])){
-            fnameDst[i] = '_';
+int EmuFATFSBase::registerReadCache(ReadCacheBlock *blocks, uint16_t blockCount, void *pool, uint32_t blockSize, uint16_t *index, uint16_t indexSize){
+    int err = 0;
+    
+    if (blocks) {
+        cretassure(blockCount && blockCount < kNoFile && pool, "Need at least one block and a pool");
+        cretassure(blockSize && (blockSize & (blockSize-1)) == 0, "blockSize needs to be a power of two");
+        cretassure(index && indexSize && (indexSize & (indexSize-1)) == 0, "indexSize needs to be a power of two");
+        for (uint16_t i=0; i<blockCount; i++) {
+            blocks[i].offset = 0;
+            blocks[i].length = 0;
+            blocks[i].fileIdx = kNoFile;
+            blocks[i].nextInBucket = kNoFile;
+            blocks[i].referenced = false;
+            blocks[i].data = (uint8_t*)pool + (size_t)i * blockSize;
         }
+        for (uint16_t i=0; i<indexSize; i++) index[i] = kNoFile;
     }
+    _readCacheBlocks = blocks;
+    _readCacheBlockCount = blocks ? blockCount : 0;
+    _readCacheIndex = blocks ? index : NULL;
+    _readCacheIndexSize = blocks ? indexSize : 0;
+    _readCacheBlockSize = blocks ? blockSize : 0;
+    _readCacheHand = 0;
+    _readCacheStats = {};
     
-    if (!startCluster){
-      startCluster = _nextFreeCluster;
-      uint32_t neededClusters = fileSize / BYTES_PER_CLUSTER;
-      if (fileSize & (BYTES_PER_CLUSTER -1)) neededClusters++;
-
-      if (!neededClusters) neededClusters = 1;
+error:
+    return -err;
+}
 
-      cretassure(startCluster + neededClusters < 0x10000, "Not enough sectors left to store file");
-      
-      _nextFreeCluster += neededClusters;
-    }else{
-      _nextFreeCluster = 0; //disable adding files statically
+void EmuFATFSBase::invalidateReadCache(uint16_t fileIdx, uint64_t offset, uint64_t length){
+    uint64_t end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+    uint64_t firstBlock = offset & ~(uint64_t)(_readCacheBlockSize-1);
+
+    if (fileIdx != kNoFile && _readCacheBlockSize && (end - firstBlock) / _readCacheBlockSize < _readCacheBlockCount) {
+        //a few blocks (the usual provider write), look them up instead of walking the whole cache
+        for (uint64_t pos = firstBlock; pos < end; pos += _readCacheBlockSize) {
+            ReadCacheBlock *blk = readCacheLookup(fileIdx, pos);
+            if (!blk) continue;
+            readCacheDrop(blk);
+            _readCacheStats.invalidations++;
+        }
+        return;
     }
-        
-    {
-        FileEntry *cfe = &_fileStorage[_usedFiles];
-        cfe->f_read = f_read;
-        cfe->f_write = f_write;
-        cfe->filename = fnameDst;
-        cfe->filenameLenNoSuffix = (uint32_t)strlen(fnameDst);
-        cfe->fileSize = fileSize;
-        cfe->startCluster = startCluster;
-        cfe->isDynamicFile = true;
+    for (uint16_t i=0; i<_readCacheBlockCount; i++) {
+        ReadCacheBlock *blk = &_readCacheBlocks[i];
+        if (blk->fileIdx == kNoFile) continue;
+        if (fileIdx != kNoFile && (blk->fileIdx != fileIdx || blk->offset >= end || blk->offset + blk->length <= offset)) continue;
+        readCacheDrop(blk);
+        _readCacheStats.invalidations++;
     }
+}
+
+int EmuFATFSBase::registerStats(Stats *stats, FileStats *fileStats, uint16_t fileStatsCnt, cb_clock clock){
+    int err = 0;
     
-    _usedFiles++;
-    _usedFilenamesBytes += neededNameBytes;
+    cretassure(kStatsEnabled || !stats, "Built without EMUFATFS_STATS");
+    _stats = stats;
+    _fileStats = stats ? fileStats : NULL;
+    _fileStatsCnt = stats && fileStats ? fileStatsCnt : 0;
+    _statsClock = stats ? clock : NULL;
     
 error:
     return -err;
 }
 
+void EmuFATFSBase::registerTrace(cb_trace cb, void *ctx, cb_clock clock){
+    _traceCb = cb;
+    _traceCtx = cb ? ctx : NULL;
+    _traceClock = cb ? clock : NULL;
+}
 
-void EmuFATFSBase::registerNewfileCallback(cb_newFile f_newfilecb){
-    _newfilecb = f_newfilecb;
+void EmuFATFSBase::traceHeader(TraceHeader *header, uint32_t ticksPerSecond){
+    finalize();
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "EFTR", sizeof(header->magic));
+    header->version = kTraceVersion;
+    header->bytesPerSector = static_cast<uint16_t>(BYTES_PER_SECTOR);
+    header->volumeType = _volumeType;
+    header->sectorsPerClusterShift = _sectorsPerClusterShift;
+    header->ticksPerSecond = ticksPerSecond;
+    header->volumeBytes = SECTOR_OFFSET(TOTAL_SECTORS);
+}
+
+int EmuFATFSBase::flush(){
+    int err = 0;
+    const FileEntry *cfe = NULL;
+    
+    if (_writeBufferFile == kNoFile) return 0;
+    cfe = &_fileStorage[_writeBufferFile];
+    
+    /*
+        Unaligned head, whole blocks and unaligned tail go out in separate provider calls,
+        head and tail only exist when the host wrote elsewhere (or flush() was called) in the middle of a block.
+        Written bytes leave the buffer right away, whatever failed stays buffered for the next attempt.
+     */
+    while (_writeBufferStart < _writeBufferEnd) {
+        uint32_t pos = _writeBufferStart;
+        uint32_t firstBlock = (pos + _writeBlockSize-1) & ~(_writeBlockSize-1);
+        uint32_t endBlock = _writeBufferEnd & ~(_writeBlockSize-1);
+        uint32_t end = pos < firstBlock ? firstBlock : (pos < endBlock ? endBlock : _writeBufferEnd);
+        int32_t didWrite = 0;
+
+        if (end > _writeBufferEnd) end = _writeBufferEnd;
+        didWrite = fileWriteThrough(cfe, _writeBufferBase + pos, &_writeBuffer[pos], end - pos);
+        _writeStats.providerWrites++;
+        cretassure(didWrite > 0, "Provider write failed, keeping pending data");
+        if ((uint32_t)didWrite > end - pos) didWrite = end - pos;
+        if (pos == firstBlock) _writeStats.blockWrites += didWrite / _writeBlockSize;
+        _writeBufferStart += didWrite;
+    }
+    _writeBufferFile = kNoFile;
+    
+error:
+    return -err;
 }
@@ -8,90 +8,905 @@
 #ifndef EmuFATFS_hpp
 #define EmuFATFS_hpp
 
+#include "fatfs.h"
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <atomic>
+#include <type_traits>
 
 namespace tihmstar {
 
 class EmuFATFSBase {
 public:
+    enum VolumeType : uint8_t {
+        kVolumeTypeFAT16 = 0,
+        kVolumeTypeFAT32,
+        kVolumeTypeExFAT
+    };
+
+    /*
+        Fixed FAT16 layout: bootsector, 2x 128KiB FAT, 128KiB root directory, data region
+     */
+    static constexpr uint32_t kReservedSectors = 1;
+    static constexpr uint32_t kFATBytes = 0x20000;
+    static constexpr uint32_t kRootDirectoryBytes = 0x20000;
+    static constexpr uint8_t kMaxSectorsPerClusterShift = 7; //128 sectors per cluster
+
+    /*
+        FAT32 layout: 32 reserved sectors (FSInfo at 1, backup at 6/7), 2x FAT sized for the data clusters,
+        the root directory is a 128KiB cluster chain at the start of the data region
+     */
+    static constexpr uint32_t kFAT32ReservedSectors = 32;
+    static constexpr uint32_t kFAT32FSInfoSector = 1;
+    static constexpr uint32_t kFAT32BackupBootSector = 6;
+    static constexpr uint32_t kFAT32MinClusters = 0x10000;
+    static constexpr uint64_t kFAT32DefaultVolumeBytes = 0x4000000000; //256GiB, see setVolumeSize()
+
+    /*
+        exFAT layout: main and backup boot region (12 sectors each), a single FAT, cluster heap with
+        root directory chain, up-case table, files (contiguous, NoFatChain) and the allocation bitmap behind the last file
+     */
+    static constexpr uint32_t kExFATBootRegionSectors = 12;
+    static constexpr uint32_t kExFATMinClusters = 0x10000;
+
+    static constexpr uint32_t kMaxPlannedClusters = 0x400000; //adaptive cluster size keeps the FAT at <= 16MiB
+
+    static constexpr uint16_t kNoFile = 0xFFFF;
+    static constexpr uint32_t kMaxDirectoryBytes = 0x200000; //65536 entries
+    static constexpr uint8_t kMaxEntriesPerSet = 21; //255 chars need 20 LFN entries + the short entry
+
     typedef int32_t (*cb_read)(uint32_t offset, void *buf, uint32_t size, const char *filename);
+    typedef int32_t (*cb_readRef)(uint32_t offset, const void **outPtr, uint32_t size, const char *filename);
     typedef int32_t (*cb_write)(uint32_t offset, const void *buf, uint32_t size, const char *filename);
     typedef void (*cb_newFile)(const char *filename, const char filenameSuffix[3], uint32_t fileSize, uint32_t clusterLocation);
 
+    /*
+        Context variants: fileIdx is the position of the file in the order it was added (since the last resetFiles).
+        Offsets are 64bit, so these are the only providers which can back files larger than 4GiB (exFAT).
+     */
+    typedef int32_t (*cb_readCtx)(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size);
+    typedef int32_t (*cb_writeCtx)(void *ctx, uint16_t fileIdx, uint64_t offset, const void *buf, uint32_t size);
+    typedef void (*cb_newFileCtx)(void *ctx, const char *filename, const char filenameSuffix[3], uint32_t fileSize, uint32_t clusterLocation);
+
+    /*
+        Async variants: start the transfer and return 0 (<0 if it couldn't be started),
+        then report it with completeProviderIO(token, result), which may also happen before the start call returns.
+     */
+    typedef int (*cb_readAsync)(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size, uint16_t token);
+    typedef int (*cb_writeAsync)(void *ctx, uint16_t fileIdx, uint64_t offset, const void *buf, uint32_t size, uint16_t token);
+    typedef void (*cb_hostComplete)(void *ctx, uint16_t requestId, int32_t result);
+
     struct FileEntry{
         cb_read f_read;
+        cb_readRef f_readRef;
         cb_write f_write;
+        cb_readCtx f_readCtx;
+        cb_writeCtx f_writeCtx;
+        cb_readAsync f_readAsync;
+        cb_writeAsync f_writeAsync;
+        void *ctx;
         const char *filename;
         uint32_t filenameLenNoSuffix;
-        uint32_t fileSize;
+        uint64_t fileSize;
         uint32_t startCluster;
+        uint32_t clusterCount;
         bool isDynamicFile;
+        /*
+            Directories are entries without providers, fileSize is the size of their generated entries.
+            parent is kNoFile for everything in the root directory.
+         */
+        bool isDirectory;
+        uint16_t parent;
+        uint16_t nextSibling;
+        uint16_t firstChild;
+        uint16_t lastChild;
+        uint16_t nextByName; //next root entry in the same short name bucket
+        //sequential access detection for read-ahead
+        uint64_t lastReadEnd;
+        uint8_t sequentialReads;
     };
-    
+
+    /*
+        Run of host written FAT entries for clusters we don't emulate: startCluster..startCluster+clusterCount-1
+        chain into each other, the last one holds next. Once a dynamic file points into it, fileIdx/fileCluster
+        map the run to its position in that file.
+     */
+    struct ChainExtent{
+        uint32_t startCluster;
+        uint32_t clusterCount;
+        uint32_t next;
+        uint32_t fileCluster;
+        uint16_t fileIdx;
+    };
+
+    /*
+        Coalescing ratio is hostWrites/providerWrites
+     */
+    struct WriteBufferStats{
+        uint64_t hostWrites;     //writes handed to the buffer
+        uint64_t hostBytes;
+        uint64_t providerWrites; //writes issued to the providers
+        uint64_t blockWrites;    //whole aligned blocks they covered
+    };
+
+    /*
+        Read-ahead buffer. The host accessors schedule slots (Pending), prefetch() fills them (Loading -> Valid),
+        only state is shared, so prefetch() may run on its own thread next to the host accessors.
+     */
+    struct ReadAheadSlot{
+        std::atomic<uint8_t> state;
+        bool stale; //written by the host since it was scheduled
+        uint16_t fileIdx;
+        uint32_t length;
+        uint64_t offset;
+        uint8_t *data;
+    };
+    enum ReadAheadState : uint8_t{
+        kReadAheadFree = 0,
+        kReadAheadPending,
+        kReadAheadLoading,
+        kReadAheadValid
+    };
+    static constexpr uint8_t kReadAheadTrigger = 2; //sequential reads before prefetching starts
+
+    /*
+        Read cache block, holds [offset, offset+length) of fileIdx (kNoFile while free).
+        referenced is the CLOCK bit: set on every hit, cleared when the hand passes.
+     */
+    struct ReadCacheBlock{
+        uint64_t offset;
+        uint32_t length;
+        uint16_t fileIdx;
+        uint16_t nextInBucket; //next block in the same index bucket
+        bool referenced;
+        uint8_t *data;
+    };
+    struct ReadCacheStats{
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t invalidations; //blocks dropped because the data changed
+    };
+    template <uint16_t TMPL_blocks, uint32_t TMPL_block_size>
+    struct ReadCacheArena{
+        static_assert(TMPL_blocks && TMPL_block_size && (TMPL_block_size & (TMPL_block_size-1)) == 0, "block size needs to be a power of two");
+        static constexpr uint16_t indexSizeFor(uint32_t blocks){
+            uint16_t size = 1;
+            while (size < blocks && size < 0x8000) size <<= 1;
+            return size;
+        }
+        static constexpr uint16_t kIndexSize = indexSizeFor(TMPL_blocks);
+
+        ReadCacheBlock blocks[TMPL_blocks];
+        uint16_t index[kIndexSize];
+        uint8_t pool[TMPL_blocks*TMPL_block_size];
+    };
+
+    /*
+        Queued host request, state is shared with completeProviderIO() which may run in another context
+     */
+    struct HostRequest{
+        std::atomic<uint8_t> state;
+        bool isWrite;
+        uint64_t offset;
+        uint8_t *buf;
+        uint32_t size;
+        uint32_t done;
+        uint32_t providerSize; //bytes handed to the provider in flight
+        int32_t providerResult;
+        uint64_t providerStart; //clock ticks when the provider was started, for the stats
+        cb_hostComplete cb;
+        void *ctx;
+    };
+    enum HostRequestState : uint8_t{
+        kHostRequestFree = 0,
+        kHostRequestQueued,
+        kHostRequestWaiting,
+        kHostRequestProviderDone
+    };
+    static constexpr uint16_t kSyncProviderToken = 0xFFFF;
+
+    enum ExtentType : uint8_t{
+        kExtentData = 0,    //generated or provided content
+        kExtentZero,        //allocated but reads as zeros: unused FAT and directory space, file slack
+        kExtentUnallocated  //free clusters
+    };
+    struct DiskExtent{
+        uint64_t offset;
+        uint64_t length;
+        ExtentType type;
+    };
+
+    /*
+        Instrumentation, only compiled in with EMUFATFS_STATS (otherwise every hook is dead code).
+        All counters are relaxed atomics in caller provided storage, so another thread can snapshot them at any time.
+        Latencies are in ticks of the registered clock, bucket 0 counts calls below one tick, bucket i those which took
+        [2^(i-1), 2^i) ticks, the last one everything above.
+     */
+#ifdef EMUFATFS_STATS
+    static constexpr bool kStatsEnabled = true;
+#else
+    static constexpr bool kStatsEnabled = false;
+#endif
+    static constexpr uint8_t kLatencyBuckets = 32;
+    typedef uint64_t (*cb_clock)(void);
+
+    enum StatsRegion : uint8_t{
+        kStatsRegionBoot = 0,   //everything in front of the first FAT
+        kStatsRegionFAT,
+        kStatsRegionRoot,       //FAT16 root directory region, FAT32/exFAT root directory chain
+        kStatsRegionData,       //including exFAT up-case table and allocation bitmap
+        kStatsRegionCount
+    };
+    struct RegionStats{
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> bytes;
+    };
+    struct LatencyHistogram{
+        std::atomic<uint64_t> buckets[kLatencyBuckets];
+    };
+    struct FileStats{
+        std::atomic<uint64_t> reads;  //provider invocations, including read-ahead and hostReadRef
+        std::atomic<uint64_t> writes;
+    };
+    struct Stats{
+        RegionStats hostReads[kStatsRegionCount];   //queued requests count once, when submitted
+        RegionStats hostWrites[kStatsRegionCount];
+        LatencyHistogram providerRead;              //async providers: start call until completeProviderIO
+        LatencyHistogram providerWrite;
+        LatencyHistogram rootDirectory;             //readRootDirectory
+        LatencyHistogram fileAllocationTable;       //readFileAllocationTable
+    };
+
+    /*
+        Access trace: every hostRead/hostWrite (queued requests once, when submitted) is handed to the trace callback
+        before it gets served, writes together with their payload. Stored as TraceHeader followed by the records,
+        each directly followed by its payload, all little endian. That is the format bench/EmuFATFSReplay reads.
+     */
+    static constexpr uint16_t kTraceVersion = 1;
+    enum TraceOp : uint8_t{
+        kTraceRead = 0,
+        kTraceWrite
+    };
+    struct TraceHeader{
+        char magic[4]; //"EFTR"
+        uint16_t version;
+        uint16_t bytesPerSector;
+        uint8_t volumeType;
+        uint8_t sectorsPerClusterShift;
+        uint16_t reserved;
+        uint32_t ticksPerSecond;
+        uint64_t volumeBytes;
+    };
+    struct TraceRecord{
+        uint64_t timestamp; //clock ticks, 0 without a clock
+        uint64_t offset;
+        uint32_t size;
+        uint8_t op;
+        uint8_t reserved[3];
+    };
+    typedef void (*cb_trace)(void *ctx, const TraceRecord *record, const void *payload);
+
 private:
     FileEntry *_fileStorage;
     const uint16_t _maxFileStorageEntires;
     uint16_t _usedFiles;
+    uint16_t *_clusterIndex; //file indices sorted by startCluster
+    uint16_t _clusterIndexCnt;
     
+    FAT_DirectoryTableEntry_t *_rootDirectoryCache;
+    const uint16_t _rootDirectoryCacheSize;
+    uint16_t _rootDirectoryEntries;
+    bool _rootDirectoryCacheValid;
+    uint16_t _rootFirstChild;
+    uint16_t _rootLastChild;
+
+    /*
+        The root directory as the host last saw it, a checksum per 32 byte slot (generated image or host written).
+        Host writes only process the slots which changed, root entries are found by short name through _nameBuckets.
+     */
+    uint32_t *_rootShadow;
+    const uint16_t _rootShadowSlots;
+    uint16_t _rootShadowGenerated; //slots which currently hold the generated image
+    uint16_t *_nameBuckets;
+    const uint16_t _nameBucketCount; //power of two
+
+    FAT_DirectoryTableEntry_t *_directoryCache; //image of the most recently read subdirectory
+    const uint16_t _directoryCacheSize;
+    uint16_t _directoryCacheOwner;
+    uint16_t _lastDirectory;
+
+    ChainExtent *_chainExtents; //sorted by startCluster
+    const uint16_t _maxChainExtents;
+    uint16_t _chainExtentsCnt;
+    bool _chainsDirty;
+
+    uint8_t *_writeBuffer;
+    uint32_t _writeBufferSize;
+    uint32_t _writeBlockSize;
+    uint16_t _writeBufferFile; //kNoFile while nothing is pending
+    uint64_t _writeBufferBase; //file offset of _writeBuffer[0], block aligned
+    uint32_t _writeBufferStart; //pending bytes are [start, end) of _writeBuffer
+    uint32_t _writeBufferEnd;
+    WriteBufferStats _writeStats;
+
+    ReadAheadSlot *_readAheadSlots;
+    uint16_t _readAheadSlotCount;
+    uint32_t _readAheadSlotSize;
+
+    ReadCacheBlock *_readCacheBlocks;
+    uint16_t _readCacheBlockCount;
+    uint16_t *_readCacheIndex; //bucket heads, blocks hashed by (fileIdx, offset)
+    uint16_t _readCacheIndexSize; //power of two
+    uint16_t _readCacheHand;
+    uint32_t _readCacheBlockSize;
+    ReadCacheStats _readCacheStats;
+
+    HostRequest *_requests;
+    uint16_t _requestDepth;
+    uint16_t _requestNext; //allocation cursor
+    uint16_t _requestCount; //slots not Free
+    HostRequest _syncRequest; //blocking provider calls of the synchronous accessors
+
+    Stats *_stats;
+    FileStats *_fileStats; //indexed by fileIdx
+    uint16_t _fileStatsCnt;
+    cb_clock _statsClock;
+
+    cb_trace _traceCb;
+    void *_traceCtx;
+    cb_clock _traceClock;
+
     char *_filenamesBuf;
     const size_t _filenamesBufSize;
     size_t _usedFilenamesBytes;
 
-    uint16_t _bytesPerSector;
+    const VolumeType _volumeType;
+    uint8_t _bytesPerSectorShift;
+    uint8_t _sectorsPerClusterShift;
+    uint32_t _reservedSectors;
+    uint32_t _sectorsPerFAT;
+    uint32_t _rootDirectorySectors;
+    uint32_t _rootDirectoryClusters;
+    uint32_t _totalSectors;
+    uint32_t _clusterLimit;
+    uint32_t _clusterHighWater;
+    uint64_t _volumeBytes; //FAT32 size target
+    uint32_t _bitmapCluster;
+    uint32_t _bitmapClusters;
+    bool _adaptiveClusterSize;
+    bool _layoutPending;
+    bool _layoutFinalized;
+    bool _sharedReaders; //hostRead must not touch any state, see prepareSharedReads()
+
+    uint32_t _generation; //bumped whenever the file set changes behind the host's back
+    uint16_t _updateDepth;
+    bool _updateChanged;
+    bool _inNewfileCallback; //files the host created itself don't count as medium change
     
     char _volumeLabel[12];
-    uint16_t _nextFreeCluster;
+    uint32_t _nextFreeCluster;
     cb_newFile _newfilecb;
+    cb_newFileCtx _newfilecbCtx;
+    void *_newfilecbCtxArg;
 
 #ifdef XCODE
 public:
 #endif
 #pragma mark private
-    const FileEntry *getFileForSector(uint16_t sector);
+    uint32_t clustersForSize(uint64_t size);
+    void indexFile(uint16_t fileIdx);
+    void rebuildClusterIndex();
+    uint16_t clusterIndexUpperBound(uint32_t cluster);
+    FileEntry *getFileForCluster(uint32_t cluster);
+    bool isEmulatedCluster(uint32_t cluster);
+    uint16_t chainExtentUpperBound(uint32_t cluster);
+    int eraseChainExtents(uint32_t startCluster, uint32_t endCluster);
+    int storeChainExtent(uint32_t startCluster, uint32_t clusterCount, uint32_t next);
+    void resolveChains();
+    uint16_t longFilenameLength(const FileEntry *cfe);
+    uint8_t lfnEntriesForFile(const FileEntry *cfe);
+    uint8_t directoryEntriesForFile(const FileEntry *cfe);
+    void buildShortName(uint16_t fileIdx, char shortName[11]);
+    uint8_t buildFixedEntries(uint16_t dirIdx, FAT_DirectoryTableEntry_t *set);
+    uint8_t buildEntrySet(uint16_t fileIdx, FAT_DirectoryTableEntry_t *set);
+    uint8_t buildExFATEntrySet(uint16_t fileIdx, FAT_DirectoryTableEntry_t *set);
+    uint32_t generateDirectory(uint16_t dirIdx, uint32_t offset, void *buf, uint32_t size);
+    void buildRootDirectoryCache();
+    void invalidateDirectoryCaches();
+    void invalidateDirectoryCache(uint16_t dirIdx);
+    void noteFileSetChanged();
+    void updateGeometry();
+    int planLayout();
+    int placeDirectories();
+
     int32_t readFileAllocationTable(uint32_t offset, void *buf, uint32_t size);
     int32_t readBootsector(uint32_t offset, void *buf, uint32_t size);
+    int32_t readExFATBootRegion(uint32_t offset, void *buf, uint32_t size);
     int32_t readRootDirectory(uint32_t offset, void *buf, uint32_t size);
+    int32_t readDirectory(uint16_t dirIdx, uint32_t offset, void *buf, uint32_t size);
+    int32_t readAllocationBitmap(uint32_t offset, void *buf, uint32_t size);
+    int32_t readUpcaseTable(uint32_t offset, void *buf, uint32_t size);
+    uint32_t dataRegionChunk(uint64_t offset, uint32_t size, const FileEntry **outFile);
+    bool chainRegionChunk(uint64_t offset, uint32_t *size, const FileEntry **outFile, uint64_t *outFileOffset);
+    int32_t fileRead(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size);
+    int32_t fileReadThrough(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size);
+    uint32_t readAheadLookup(uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size);
+    void trackSequentialRead(uint16_t fileIdx, uint64_t offset, uint32_t size);
+    void scheduleReadAhead(uint16_t fileIdx, uint64_t readStart, uint64_t readEnd);
+    void invalidateReadAhead(uint16_t fileIdx, uint64_t start, uint64_t end);
+    uint16_t *readCacheBucket(uint16_t fileIdx, uint64_t blockOffset);
+    ReadCacheBlock *readCacheLookup(uint16_t fileIdx, uint64_t blockOffset);
+    void readCacheLink(ReadCacheBlock *blk, uint16_t fileIdx, uint64_t blockOffset, uint32_t length);
+    void readCacheDrop(ReadCacheBlock *blk);
+    ReadCacheBlock *readCacheVictim();
+    void readCacheInsert(uint16_t fileIdx, uint64_t blockOffset, const void *data, uint32_t length);
+    int32_t cachedRead(const FileEntry *cfe, uint64_t offset, void *buf, uint32_t size);
+    void overlayPendingWrite(uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size);
+    int32_t waitProviderIO(int started);
+    uint32_t asyncChunk(uint64_t offset, uint32_t size, bool isWrite, const FileEntry **outFile, uint64_t *outFileOffset);
+    int startRequestIO(HostRequest *req, uint16_t requestId, const FileEntry *cfe, uint64_t fileOffset, uint32_t size);
+    int advanceRequest(uint16_t requestId);
+    int submitRequest(bool isWrite, uint64_t offset, void *buf, uint32_t size, cb_hostComplete cb, void *ctx);
+    uint32_t usedClusterEnd();
+    uint32_t allocatedClusters();
+    uint64_t extentAt(uint64_t offset, ExtentType *outType);
+    uint64_t statsTicks(){ return kStatsEnabled && _stats && _statsClock ? _statsClock() : 0; }
+    void recordLatency(LatencyHistogram *hist, uint64_t startTicks);
+    void recordProviderCall(const FileEntry *cfe, bool isWrite, uint64_t startTicks);
+    void recordHostAccess(bool isWrite, uint64_t offset, uint32_t size);
+    void traceHostAccess(bool isWrite, uint64_t offset, uint32_t size, const void *payload);
+    int32_t readRegions(uint64_t offset, void *buf, uint32_t size);
+    int32_t writeRegions(uint64_t offset, const void *buf, uint32_t size);
+    int32_t fileWrite(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size);
+    int32_t fileWriteThrough(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size);
+    int32_t bufferedWrite(const FileEntry *cfe, uint64_t offset, const void *buf, uint32_t size);
 
     int32_t catchRootDirectoryAccess(uint32_t offset, const void *buf, uint32_t size);
+    void indexShortName(uint16_t fileIdx);
+    bool longFilenameMatches(const FileEntry *cfe, const char *name);
+    FileEntry *findRootEntry(const FAT_DirectoryTableFileEntry_t *dfe, const char *longName);
+    int32_t updateRootEntry(FileEntry *cfe, const FAT_DirectoryTableFileEntry_t *dfe, bool *clustersChanged);
     int32_t catchFileAllocationTableAccess(uint32_t offset, const void *buf, uint32_t size);
 
+    bool nameMatches(const FileEntry *cfe, const char *name, size_t nameLen);
+    bool isDirectoryPath(uint16_t dirIdx, const char *path, size_t pathLen);
+    uint16_t findDirectory(uint16_t parent, const char *name, size_t nameLen);
+    int resolveDirectory(const char *path, uint16_t *outDirectory, const char **outName);
+    char *storeFilename(const char *name, size_t nameLen, const char *filenameSuffix, size_t *outNeededBytes);
+    int linkEntry(uint16_t fileIdx, uint16_t parent);
+    int addDirectoryEntry(const char *name, size_t nameLen, uint16_t parent);
+    int addFileEntry(const char *filename, const char *filenameSuffix, uint64_t fileSize, uint32_t startCluster, bool isDynamicFile, const FileEntry &providers);
+
+    template <class T>
+    static int32_t providerRead(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size){
+        return static_cast<T*>(ctx)->read(fileIdx, offset, buf, size);
+    }
+    template <class T>
+    static int32_t providerWrite(void *ctx, uint16_t fileIdx, uint64_t offset, const void *buf, uint32_t size){
+        return static_cast<T*>(ctx)->write(fileIdx, offset, buf, size);
+    }
+    template <class T>
+    static auto providerWriteFor(int) -> decltype(&T::write, cb_writeCtx()) { return providerWrite<T>; }
+    template <class T>
+    static cb_writeCtx providerWriteFor(...) { return NULL; }
+
+protected:
+    uint32_t readDataRegion(uint64_t offset, void *buf, uint32_t size);
+    void noteHostAccess(bool isWrite, uint64_t offset, uint32_t size, const void *payload){
+        if (_traceCb) traceHostAccess(isWrite, offset, size, payload);
+        if (kStatsEnabled && _stats) recordHostAccess(isWrite, offset, size);
+    }
+
 #ifndef XCODE
 public:
 #endif
 #pragma mark public
-    EmuFATFSBase(FileEntry *fileStorage, uint16_t maxFileStorageEntires, char *filenamesBuf, size_t filenamesBufSize, const char *volumeLabel = NULL, uint16_t bytesPerSector = 0x400);
+    EmuFATFSBase(FileEntry *fileStorage, uint16_t *clusterIndexStorage, uint16_t maxFileStorageEntires, char *filenamesBuf, size_t filenamesBufSize, FAT_DirectoryTableEntry_t *rootDirectoryStorage, uint16_t maxRootDirectoryEntries, uint32_t *rootShadowStorage, uint16_t rootShadowSlots, uint16_t *nameBucketStorage, uint16_t nameBucketCount, FAT_DirectoryTableEntry_t *directoryCacheStorage, uint16_t maxDirectoryCacheEntries, ChainExtent *chainStorage, uint16_t maxChainExtents, const char *volumeLabel = NULL, uint16_t bytesPerSector = 0x400, uint8_t sectorsPerCluster = 128, VolumeType volumeType = kVolumeTypeFAT16);
     ~EmuFATFSBase();
     
 #pragma mark host accessors
-    int32_t hostRead(uint32_t offset, void *buf, uint32_t size);
-    int32_t hostWrite(uint32_t offset, const void *buf, uint32_t size);
+    int32_t hostRead(uint64_t offset, void *buf, uint32_t size);
+    /*
+        Returns how many of the next bytes can be served without copying.
+        If *outPtr is set, the bytes are borrowed from the provider (or the root directory image),
+        otherwise that range needs to be fetched through hostRead.
+     */
+    int32_t hostReadRef(uint64_t offset, const void **outPtr, uint32_t size);
+    //negative results of write providers (including the deletion notice) are passed on to the host
+    int32_t hostWrite(uint64_t offset, const void *buf, uint32_t size);
+    /*
+        hostWrite for shared readers (after prepareSharedReads): data region writes go straight to the providers,
+        nothing of the instance changes. Returns how many bytes were handled, 0 if the write needs hostWrite
+        (boot sector, FAT, directories, clusters no file owns yet, async providers, write buffer/caches registered).
+     */
+    int32_t sharedWrite(uint64_t offset, const void *buf, uint32_t size);
+
+    /*
+        Non-blocking accessors on top of a caller provided queue of depth requests. Submitting returns the request id
+        (or <0 while all slots are in flight, a slot is free again once its request completed), poll() moves the requests
+        forward until they wait on an async provider and fires cb(ctx, requestId, bytes) for the finished ones,
+        it returns how many are still in flight. A failing provider ends its request with cb(ctx, requestId, <0)
+        and makes poll() return that error instead of the count.
+        Like SCSI simple tagged commands, overlapping requests in flight complete in no particular order.
+     */
+    int registerRequestQueue(HostRequest *storage, uint16_t depth);
+    int submitRead(uint64_t offset, void *buf, uint32_t size, cb_hostComplete cb, void *ctx);
+    int submitWrite(uint64_t offset, const void *buf, uint32_t size, cb_hostComplete cb, void *ctx);
+    int poll();
+    //token is kSyncProviderToken when a synchronous accessor (or prefetch) waits for the transfer
+    void completeProviderIO(uint16_t token, int32_t result);
     
     uint32_t diskBlockNum();
     uint32_t diskBlockSize();
     uint32_t bytesPerCluster();
+    /*
+        exFAT entry sets and the allocation bitmap aren't parsed, so new files, renames and deletes would be lost.
+        Those volumes are write protected (report it in MODE SENSE): only data of existing files can be written,
+        every other write fails.
+     */
+    bool isWriteProtected();
+    /*
+        FAT32 volumes have a fixed size (kFAT32DefaultVolumeBytes unless set), so the host has free space for new files
+        and the capacity doesn't change with the file set. It is rounded down to whole clusters, capped at what the
+        cluster size can address and grown if the files need more. The FAT for the free space is generated on demand.
+     */
+    void setVolumeSize(uint64_t volumeBytes);
+    /*
+        SEEK_DATA style block status: describes [offset, offset+length) as consecutive extents (adjacent ones of the same
+        type merged) without generating any content. Returns how many of maxExtents were filled, if the last one ends
+        before offset+length continue the query from there. Ranges past the end of the volume aren't reported.
+     */
+    int queryExtents(uint64_t offset, uint64_t length, DiskExtent *extents, uint16_t maxExtents);
 
 #pragma mark emu providers
+    /*
+        With sectorsPerCluster == 0 the cluster size is picked when the layout is finalized:
+        the smallest one which fits all registered files. This happens on the first host access
+        (or diskBlockNum/bytesPerCluster), files added afterwards keep using the chosen size.
+        It also maps host written FAT chains to the dynamic files pointing into them.
+     */
+    int finalize(){
+        if (_chainsDirty) resolveChains();
+        return _layoutPending ? planLayout() : 0;
+    }
     void resetFiles();
+    /*
+        Filenames may contain a path ("2024/06/cam0/clip"), missing directories are created on the way.
+        Directory clusters are handed out on finalize(), behind the files which were added so far.
+     */
+    int addDirectory(const char *path);
     int addFile(const char *filename, const char *filenameSuffix, uint32_t fileSize, cb_read f_read, cb_write f_write = NULL);
+    int addFile(const char *filename, const char *filenameSuffix, uint64_t fileSize, cb_readCtx f_read, cb_writeCtx f_write, void *ctx);
+    int addFileRef(const char *filename, const char *filenameSuffix, uint32_t fileSize, cb_readRef f_readRef, cb_write f_write = NULL);
     int addFileDynamic(const char *filename, const char *filenameSuffix, uint32_t fileSize, uint32_t startCluster, cb_read f_read, cb_write f_write = NULL);
+    int addFileDynamic(const char *filename, const char *filenameSuffix, uint64_t fileSize, uint32_t startCluster, cb_readCtx f_read, cb_writeCtx f_write, void *ctx);
+    /*
+        Backed by async providers, the synchronous accessors spin until completeProviderIO() comes in,
+        so that has to happen from another context (DMA/IRQ, thread) or inside the start call.
+     */
+    int addFileAsync(const char *filename, const char *filenameSuffix, uint64_t fileSize, cb_readAsync f_read, cb_writeAsync f_write, void *ctx);
     void registerNewfileCallback(cb_newFile f_newfilecb);
+    void registerNewfileCallback(cb_newFileCtx f_newfilecb, void *ctx);
+
+    /*
+        Snapshot support: copyStateFrom() takes over the file table, directory and FAT state of src (same template
+        configuration), prepareSharedReads() settles layout and root directory so that concurrent hostRead calls only read.
+        Write buffer, read-ahead, read cache (emptied), request queue and stats stay with their instance.
+     */
+    int copyStateFrom(const EmuFATFSBase &src);
+    void prepareSharedReads();
+
+    /*
+        Group changes to the file set (resetFiles, addFile, addDirectory) into one medium change.
+        While isUpdating() the host sees a half built volume, report NOT READY.
+        commitUpdate() settles the layout, rebuilds the directory images the changes touched and bumps the generation.
+        Changes outside of an update bump it right away.
+     */
+    void beginUpdate();
+    int commitUpdate();
+    bool isUpdating(){ return _updateDepth != 0; }
+    uint32_t generation(){ return _generation; }
+    /*
+        True once per change for every consumer: the MSC layer keeps its own seenGeneration
+        and turns this into UNIT ATTENTION (medium may have changed).
+     */
+    bool mediumChanged(uint32_t *seenGeneration);
+
+    /*
+        Optional write-back stage in front of the write providers: contiguous writes to one file collect in buf
+        (a multiple of blockSize, e.g. the flash erase block) and go out once buf is full or the host writes elsewhere.
+        Only whole blocks are written as such, a discontinuity in the middle of a block writes the partial head/tail on their own.
+        A failing provider write keeps the data buffered and fails the hostWrite which triggered it (or flush()).
+        Call flush() on SYNCHRONIZE CACHE / eject. Passing NULL disables the stage again.
+     */
+    int registerWriteBuffer(void *buf, uint32_t size, uint32_t blockSize);
+    int flush();
+    const WriteBufferStats &writeBufferStats(){ return _writeStats; }
+
+    /*
+        Optional read-ahead: once a file is read sequentially, the next slotCount chunks of slotSize (power of two)
+        behind the read position get scheduled into pool (slotCount*slotSize bytes). Nothing is loaded until
+        prefetch() runs, call it from the idle loop (bare metal) or a worker thread, it returns 1 when it loaded a slot.
+        Providers then need to cope with concurrent reads, resetFiles/registerReadAhead need the worker paused.
+     */
+    int registerReadAhead(ReadAheadSlot *slots, uint16_t slotCount, void *pool, uint32_t slotSize);
+    int prefetch();
+
+    /*
+        Optional read cache in front of the read providers: blockCount blocks of blockSize (power of two, e.g. the flash
+        page or the cluster size) in pool, replaced with CLOCK. Reads below blockSize load the whole block, larger ones
+        go straight to the provider and keep the whole blocks they covered. Provider writes drop the range, providers
+        whose data changes behind our back report it with invalidateReadCache(). Shared readers and async files bypass it.
+        Blocks are found through index (indexSize bucket heads, power of two, about one per block).
+     */
+    int registerReadCache(ReadCacheBlock *blocks, uint16_t blockCount, void *pool, uint32_t blockSize, uint16_t *index, uint16_t indexSize);
+    template <uint16_t TMPL_blocks, uint32_t TMPL_block_size>
+    int registerReadCache(ReadCacheArena<TMPL_blocks, TMPL_block_size> *arena){
+        return registerReadCache(arena->blocks, TMPL_blocks, arena->pool, TMPL_block_size, arena->index, arena->kIndexSize);
+    }
+    void invalidateReadCache(uint16_t fileIdx = kNoFile, uint64_t offset = 0, uint64_t length = UINT64_MAX);
+    const ReadCacheStats &readCacheStats(){ return _readCacheStats; }
+
+    /*
+        Counts into stats (and fileStats[fileIdx] for the first fileStatsCnt files), latencies are only taken with a clock.
+        Fails unless built with EMUFATFS_STATS, passing NULL stops counting.
+     */
+    int registerStats(Stats *stats, FileStats *fileStats = NULL, uint16_t fileStatsCnt = 0, cb_clock clock = NULL);
+
+    /*
+        Starts (cb != NULL) or stops tracing, timestamps come from clock. traceHeader() describes the current layout
+        for the start of a trace file.
+     */
+    void registerTrace(cb_trace cb, void *ctx, cb_clock clock = NULL);
+    void traceHeader(TraceHeader *header, uint32_t ticksPerSecond);
+
+    /*
+        Provider objects need "int32_t read(uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size)"
+        and optionally a matching "write". The calls are bound at compile time, so they get inlined into the dispatch stub.
+        Only class types match, plain callbacks keep resolving to the overloads above.
+     */
+    template <class T, std::enable_if_t<std::is_class_v<T>, int> = 0>
+    int addFile(const char *filename, const char *filenameSuffix, uint64_t fileSize, T *provider){
+        return addFile(filename, filenameSuffix, fileSize, providerRead<T>, providerWriteFor<T>(0), provider);
+    }
+    template <class T, std::enable_if_t<std::is_class_v<T>, int> = 0>
+    int addFileDynamic(const char *filename, const char *filenameSuffix, uint64_t fileSize, uint32_t startCluster, T *provider){
+        return addFileDynamic(filename, filenameSuffix, fileSize, startCluster, providerRead<T>, providerWriteFor<T>(0), provider);
+    }
 };
 
-template <uint16_t TMPL_max_Files = 5, size_t TMPL_filenames_storage_size = 0x100>
+/*
+    TMPL_bytes_per_sector == 0 keeps the sector size configurable through the constructor.
+    Otherwise the layout is known at compile time and data region reads skip the generic region dispatch.
+    TMPL_sectors_per_cluster == 0 lets finalize() pick the cluster size for the registered files.
+    TMPL_volume_type selects FAT16, FAT32 or exFAT, only the FAT16 layout is fixed enough for the fast path.
+ */
+template <uint16_t TMPL_max_Files = 5, size_t TMPL_filenames_storage_size = 0x100, uint16_t TMPL_bytes_per_sector = 0, uint8_t TMPL_sectors_per_cluster = 128, EmuFATFSBase::VolumeType TMPL_volume_type = EmuFATFSBase::kVolumeTypeFAT16>
 class EmuFATFS : public EmuFATFSBase{
+    static_assert(TMPL_bytes_per_sector == 0 || (TMPL_bytes_per_sector >= 0x200 && TMPL_bytes_per_sector <= 0x1000 && (TMPL_bytes_per_sector & (TMPL_bytes_per_sector-1)) == 0), "bytes per sector needs to be 512, 1024, 2048 or 4096");
+    static_assert((TMPL_sectors_per_cluster & (TMPL_sectors_per_cluster-1)) == 0, "sectors per cluster needs to be a power of two (or 0 for adaptive)");
+
+    /*
+        Volume label + per file one short entry and at most (nameLen+4)/13+1 LFN entries,
+        capped at what fits into the 128KiB root directory region.
+        exFAT has label, bitmap and up-case entries + per file, stream and at most nameLen/15+1 name entries.
+     */
+    static constexpr size_t kRootDirectoryEntries = TMPL_volume_type == kVolumeTypeExFAT
+        ? 3 + TMPL_max_Files*3 + TMPL_filenames_storage_size/EXFAT_FILENAME_ENTRY_MAX_NAME_LEN
+        : 1 + TMPL_max_Files*2 + TMPL_filenames_storage_size/LFN_ENTRY_MAX_NAME_LEN;
+    static constexpr uint16_t kRootDirectoryCacheSize = kRootDirectoryEntries < 0x1000 ? kRootDirectoryEntries : 0x1000;
+    //subdirectories additionally have "." and "..", larger ones are generated straight into the read buffer
+    static constexpr uint16_t kDirectoryCacheSize = kRootDirectoryEntries+1 < 0x100 ? kRootDirectoryEntries+1 : 0x100;
+    //fragments of host written files
+    static constexpr uint16_t kChainExtents = TMPL_max_Files < 0x100 ? TMPL_max_Files*4 : 0x400;
+    //the generated root directory + as many slots again for entries the host creates, slots behind it are always parsed
+    static constexpr uint16_t kRootShadowSlots = kRootDirectoryCacheSize < 0x800 ? kRootDirectoryCacheSize*2 : 0x1000;
+    static constexpr uint16_t nameBucketsFor(uint32_t files){
+        uint16_t buckets = 1;
+        while (buckets < files && buckets < 0x1000) buckets <<= 1;
+        return buckets;
+    }
+    static constexpr uint16_t kNameBuckets = nameBucketsFor(TMPL_max_Files);
+
     FileEntry _fileStorage[TMPL_max_Files];
+    uint16_t _clusterIndexStorage[TMPL_max_Files];
     char _filenamesStorage[TMPL_filenames_storage_size];
+    FAT_DirectoryTableEntry_t _rootDirectoryStorage[kRootDirectoryCacheSize];
+    uint32_t _rootShadowStorage[kRootShadowSlots];
+    uint16_t _nameBucketStorage[kNameBuckets];
+    FAT_DirectoryTableEntry_t _directoryCacheStorage[kDirectoryCacheSize];
+    ChainExtent _chainStorage[kChainExtents];
 public:
-    EmuFATFS(const char *volumeLabel = NULL, uint16_t bytesPerSector = 0x400)
-    : EmuFATFSBase(_fileStorage, TMPL_max_Files, _filenamesStorage, TMPL_filenames_storage_size, volumeLabel, bytesPerSector){
+    static constexpr bool kFixedGeometry = TMPL_bytes_per_sector != 0 && TMPL_volume_type == kVolumeTypeFAT16;
+    static constexpr uint32_t kBytesPerSector = TMPL_bytes_per_sector;
+    static constexpr uint32_t kBytesPerCluster = TMPL_bytes_per_sector * TMPL_sectors_per_cluster;
+    static constexpr uint64_t kDataRegionOffset = kReservedSectors*TMPL_bytes_per_sector + 2*kFATBytes + kRootDirectoryBytes;
+
+    EmuFATFS(const char *volumeLabel = NULL, uint16_t bytesPerSector = TMPL_bytes_per_sector ? TMPL_bytes_per_sector : 0x400)
+    : EmuFATFSBase(_fileStorage, _clusterIndexStorage, TMPL_max_Files, _filenamesStorage, TMPL_filenames_storage_size, _rootDirectoryStorage, kRootDirectoryCacheSize, _rootShadowStorage, kRootShadowSlots, _nameBucketStorage, kNameBuckets, _directoryCacheStorage, kDirectoryCacheSize, _chainStorage, kChainExtents, volumeLabel, TMPL_bytes_per_sector ? TMPL_bytes_per_sector : bytesPerSector, TMPL_sectors_per_cluster, TMPL_volume_type){
         memset(_fileStorage, 0, sizeof(_fileStorage));
         memset(_filenamesStorage, 0, sizeof(_filenamesStorage));
+        memset(_rootShadowStorage, 0, sizeof(_rootShadowStorage));
+        memset(_nameBucketStorage, 0xFF, sizeof(_nameBucketStorage)); //kNoFile
     }
     ~EmuFATFS() {
         //
     }
+
+    int32_t hostRead(uint64_t offset, void *buf, uint32_t size){
+        if (kFixedGeometry && offset >= kDataRegionOffset) {
+            finalize();
+            noteHostAccess(false, offset, size, NULL);
+            uint8_t *ptr = (uint8_t*)buf;
+            uint32_t totalRead = 0;
+            while (size) {
+                uint32_t didRead = readDataRegion(offset - kDataRegionOffset, ptr, size);
+                ptr += didRead;
+                offset += didRead;
+                size -= didRead;
+                totalRead += didRead;
+            }
+            return totalRead;
+        }
+        return EmuFATFSBase::hostRead(offset, buf, size);
+    }
+};
+
+/*
+    Lock-free concurrent reads: readers (each thread with its own readerIdx < TMPL_max_readers) traverse the published
+    snapshot of FS, update() applies changes to the other one and publishes it atomically. The old snapshot is reused
+    once every reader which could still see it left (epoch based reclamation), so updates wait for the slowest reader.
+    Data region writes go to the providers of the published snapshot like reads. Writes which change metadata
+    (boot sector, FAT, directories) are collected in the staged snapshot and published together with the next
+    hostRead/read()/update() or publishWrites() (e.g. on SYNCHRONIZE CACHE), so a batch of them costs one copy of the
+    whole state and one wait for the readers. Providers need to cope with concurrent calls.
+    With adaptive cluster size, the first update() picks the cluster size, reads before it return zeros.
+ */
+template <uint16_t TMPL_max_readers, class FS>
+class EmuFATFSConcurrent{
+    static constexpr uint8_t kNothingPublished = 0xFF;
+
+    FS _snapshotA;
+    FS _snapshotB;
+    std::atomic<uint8_t> _published;
+    std::atomic<uint64_t> _epoch;
+    std::atomic<uint64_t> _readerEpochs[TMPL_max_readers]; //0 while the reader is outside
+    std::atomic_flag _updateLock = ATOMIC_FLAG_INIT;
+    std::atomic<bool> _batchPending; //host writes wait in _batch
+    FS *_batch; //staged snapshot collecting host writes, only touched with _updateLock held
+
+    FS *snapshot(uint8_t idx){ return idx ? &_snapshotB : &_snapshotA; }
+
+    FS *enterRead(uint16_t readerIdx){
+        uint8_t idx = 0;
+        _readerEpochs[readerIdx].store(_epoch.load());
+        idx = _published.load();
+        return idx == kNothingPublished ? NULL : snapshot(idx);
+    }
+    void leaveRead(uint16_t readerIdx){
+        _readerEpochs[readerIdx].store(0, std::memory_order_release);
+    }
+
+    FS *stageUpdate(){
+        uint8_t published = 0;
+        FS *staging = NULL;
+        while (_updateLock.test_and_set(std::memory_order_acquire));
+        if (_batch) return _batch;
+        published = _published.load();
+        staging = snapshot(published == 0 ? 1 : 0);
+        if (published != kNothingPublished) staging->copyStateFrom(*snapshot(published));
+        staging->beginUpdate();
+        return staging;
+    }
+    void publishUpdate(FS *staging){
+        uint64_t oldEpoch = 0;
+        _batch = NULL;
+        _batchPending.store(false, std::memory_order_relaxed);
+        staging->commitUpdate();
+        staging->prepareSharedReads();
+        _published.store(staging == &_snapshotB ? 1 : 0);
+        
+        //readers which entered before the epoch moved on may still be on the old snapshot
+        oldEpoch = _epoch.fetch_add(1);
+        for (uint16_t i=0; i<TMPL_max_readers; i++) {
+            uint64_t e = 0;
+            while ((e = _readerEpochs[i].load()) && e <= oldEpoch);
+        }
+        _updateLock.clear(std::memory_order_release);
+    }
+
+public:
+    EmuFATFSConcurrent(const char *volumeLabel = NULL)
+    : _snapshotA(volumeLabel), _snapshotB(volumeLabel), _published{kNothingPublished}, _epoch{1}, _readerEpochs{}
+    , _batchPending{false}, _batch{NULL}
+    {
+        //
+    }
+
+    //publishes the pending host writes, reads and update() do it on their own
+    void publishWrites(){
+        if (!_batchPending.load(std::memory_order_acquire)) return;
+        while (_updateLock.test_and_set(std::memory_order_acquire));
+        if (_batch) publishUpdate(_batch);
+        else _updateLock.clear(std::memory_order_release);
+    }
+
+    template <class F>
+    auto read(uint16_t readerIdx, F f) -> decltype(f(_snapshotA)){
+        typedef decltype(f(_snapshotA)) R;
+        FS *fs = NULL;
+        publishWrites();
+        fs = enterRead(readerIdx);
+        if constexpr (std::is_void_v<R>) {
+            if (fs) f(*fs);
+            leaveRead(readerIdx);
+        }else{
+            R ret = fs ? f(*fs) : R();
+            leaveRead(readerIdx);
+            return ret;
+        }
+    }
+
+    template <class F>
+    auto update(F f) -> decltype(f(_snapshotA)){
+        typedef decltype(f(_snapshotA)) R;
+        FS *staging = stageUpdate();
+        if constexpr (std::is_void_v<R>) {
+            f(*staging);
+            publishUpdate(staging);
+        }else{
+            R ret = f(*staging);
+            publishUpdate(staging);
+            return ret;
+        }
+    }
+
+    int32_t hostRead(uint16_t readerIdx, uint64_t offset, void *buf, uint32_t size){
+        FS *fs = NULL;
+        int32_t didRead = size;
+        publishWrites();
+        fs = enterRead(readerIdx);
+        if (fs) didRead = fs->hostRead(offset, buf, size);
+        else memset(buf, 0, size);
+        leaveRead(readerIdx);
+        return didRead;
+    }
+
+    int32_t hostWrite(uint16_t readerIdx, uint64_t offset, const void *buf, uint32_t size){
+        const uint8_t *ptr = (const uint8_t*)buf;
+        uint32_t done = 0;
+        int32_t didWrite = 0;
+        FS *staging = NULL;
+        //with writes pending the published snapshot is outdated, everything joins the batch
+        if (!_batchPending.load(std::memory_order_acquire)) {
+            FS *fs = enterRead(readerIdx);
+            while (fs && done < size && (didWrite = fs->sharedWrite(offset + done, ptr + done, size - done)) > 0) done += didWrite;
+            leaveRead(readerIdx);
+            if (done == size) return size;
+        }
+        staging = stageUpdate();
+        didWrite = staging->hostWrite(offset + done, ptr + done, size - done);
+        _batch = staging;
+        _batchPending.store(true, std::memory_order_release);
+        _updateLock.clear(std::memory_order_release);
+        if (didWrite < 0) return didWrite;
+        return size;
+    }
+
+    //both snapshots count into the same storage, register before the first access
+    int registerStats(EmuFATFSBase::Stats *stats, EmuFATFSBase::FileStats *fileStats = NULL, uint16_t fileStatsCnt = 0, EmuFATFSBase::cb_clock clock = NULL){
+        int err = _snapshotA.registerStats(stats, fileStats, fileStatsCnt, clock);
+        return err ? err : _snapshotB.registerStats(stats, fileStats, fileStatsCnt, clock);
+    }
+
+    //readers call cb concurrently
+    void registerTrace(EmuFATFSBase::cb_trace cb, void *ctx, EmuFATFSBase::cb_clock clock = NULL){
+        _snapshotA.registerTrace(cb, ctx, clock);
+        _snapshotB.registerTrace(cb, ctx, clock);
+    }
 };
 
 };
@@ -0,0 +1,148 @@
+//
+//  EmuFATFSStatic.cpp
+//  EmuFATFS
+//
+
+#include "EmuFATFSStatic.hpp"
+
+using namespace tihmstar;
+
+#define BYTES_PER_SECTOR (1u << _layout.bytesPerSectorShift)
+#define CLUSTER_SHIFT (_layout.bytesPerSectorShift + _layout.sectorsPerClusterShift)
+#define FIRST_DATA_CLUSTER 2
+
+#define SECTOR_FAT_1            (EmuFATFSBase::kReservedSectors)
+#define SECTOR_FAT_2            (SECTOR_FAT_1 + (EmuFATFSBase::kFATBytes >> _layout.bytesPerSectorShift))
+#define SECTOR_ROOT_DIRECTORY   (SECTOR_FAT_2 + (EmuFATFSBase::kFATBytes >> _layout.bytesPerSectorShift))
+#define SECTOR_DATA_REGION      (SECTOR_ROOT_DIRECTORY + (EmuFATFSBase::kRootDirectoryBytes >> _layout.bytesPerSectorShift))
+#define SECTOR_OFFSET(s)        ((uint64_t)(s) << _layout.bytesPerSectorShift)
+
+#pragma mark private
+uint32_t EmuFATFSStatic::dataRegionChunk(uint64_t offset, uint32_t size, uint16_t *outFileIdx, uint64_t *outFileOffset) const{
+    uint64_t cluster = (offset >> CLUSTER_SHIFT) + FIRST_DATA_CLUSTER;
+    uint16_t lo = 0;
+    uint16_t hi = _layout.fileCount;
+
+    //first file ending behind cluster, zero sized files end where they start and are never hit
+    while (lo < hi) {
+        uint16_t mid = lo + (hi-lo)/2;
+        if (_layout.clusterEnds[mid] <= cluster) {
+            lo = mid+1;
+        }else{
+            hi = mid;
+        }
+    }
+
+    *outFileIdx = EmuFATFSBase::kNoFile;
+    if (lo == _layout.fileCount) return size; //behind the last file
+
+    {
+        uint32_t startCluster = lo ? _layout.clusterEnds[lo-1] : FIRST_DATA_CLUSTER;
+        uint64_t fileStart = (uint64_t)(startCluster - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        uint64_t fileEnd = (uint64_t)(_layout.clusterEnds[lo] - FIRST_DATA_CLUSTER) << CLUSTER_SHIFT;
+        if (offset + size > fileEnd) size = static_cast<uint32_t>(fileEnd - offset);
+        *outFileIdx = lo;
+        *outFileOffset = offset - fileStart;
+    }
+    return size;
+}
+
+#pragma mark public
+uint64_t EmuFATFSStatic::volumeBytes() const{
+    return SECTOR_OFFSET(_layout.totalSectors);
+}
+
+uint32_t EmuFATFSStatic::bytesPerCluster() const{
+    return 1u << CLUSTER_SHIFT;
+}
+
+int32_t EmuFATFSStatic::hostRead(uint64_t offset, void *buf, uint32_t size) const{
+    uint8_t *ptr = (uint8_t*)buf;
+    uint32_t totalRead = 0;
+
+    while (size) {
+        uint64_t sectorNum = offset >> _layout.bytesPerSectorShift;
+        uint32_t chunk = size;
+        uint64_t sectionOffset = 0;
+        uint64_t sectionEnd = 0;
+        const uint8_t *src = NULL;
+        uint32_t srcSize = 0;
+        uint32_t didRead = 0;
+
+        if (sectorNum < SECTOR_FAT_1) {
+            sectionEnd = SECTOR_OFFSET(SECTOR_FAT_1);
+            sectionOffset = offset;
+            src = _layout.bootsector; srcSize = 512;
+        }else if (sectorNum < SECTOR_ROOT_DIRECTORY) {
+            //both FAT copies are the same
+            sectionEnd = SECTOR_OFFSET(sectorNum < SECTOR_FAT_2 ? SECTOR_FAT_2 : SECTOR_ROOT_DIRECTORY);
+            sectionOffset = offset - SECTOR_OFFSET(sectorNum < SECTOR_FAT_2 ? SECTOR_FAT_1 : SECTOR_FAT_2);
+            src = _layout.fat; srcSize = _layout.fatBytes;
+        }else if (sectorNum < SECTOR_DATA_REGION) {
+            sectionEnd = SECTOR_OFFSET(SECTOR_DATA_REGION);
+            sectionOffset = offset - SECTOR_OFFSET(SECTOR_ROOT_DIRECTORY);
+            src = _layout.rootDirectory; srcSize = _layout.rootDirectoryBytes;
+        }
+
+        if (src) {
+            if (offset + chunk > sectionEnd) chunk = static_cast<uint32_t>(sectionEnd - offset);
+            if (sectionOffset < srcSize) {
+                didRead = srcSize - static_cast<uint32_t>(sectionOffset);
+                if (didRead > chunk) didRead = chunk;
+                memcpy(ptr, &src[sectionOffset], didRead);
+            }
+        }else{
+            uint16_t fileIdx = EmuFATFSBase::kNoFile;
+            uint64_t fileOffset = 0;
+            chunk = dataRegionChunk(offset - SECTOR_OFFSET(SECTOR_DATA_REGION), chunk, &fileIdx, &fileOffset);
+            if (fileIdx != EmuFATFSBase::kNoFile) {
+                const EmuFATFSStatic::File *f = &_layout.files[fileIdx];
+                if (fileOffset < f->size) {
+                    uint32_t readSize = f->size - fileOffset < chunk ? static_cast<uint32_t>(f->size - fileOffset) : chunk;
+                    int32_t ret = f->f_read(static_cast<uint32_t>(fileOffset), ptr, readSize, f->name);
+                    if (ret > 0) didRead = ret;
+                }
+            }
+        }
+        if (chunk > didRead) memset(&ptr[didRead], 0, chunk-didRead);
+
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+        totalRead += chunk;
+    }
+
+    return totalRead;
+}
+
+int32_t EmuFATFSStatic::hostWrite(uint64_t offset, const void *buf, uint32_t size) const{
+    const uint8_t *ptr = (const uint8_t*)buf;
+    uint32_t totalWritten = size;
+
+    //metadata is part of the read-only image, only data region writes reach the providers
+    if (offset + size <= SECTOR_OFFSET(SECTOR_DATA_REGION)) return size;
+    if (offset < SECTOR_OFFSET(SECTOR_DATA_REGION)) {
+        uint32_t skip = static_cast<uint32_t>(SECTOR_OFFSET(SECTOR_DATA_REGION) - offset);
+        ptr += skip; offset += skip; size -= skip;
+    }
+
+    while (size) {
+        uint16_t fileIdx = EmuFATFSBase::kNoFile;
+        uint64_t fileOffset = 0;
+        uint32_t chunk = dataRegionChunk(offset - SECTOR_OFFSET(SECTOR_DATA_REGION), size, &fileIdx, &fileOffset);
+
+        if (fileIdx != EmuFATFSBase::kNoFile) {
+            const EmuFATFSStatic::File *f = &_layout.files[fileIdx];
+            if (f->f_write && fileOffset < f->size) {
+                uint32_t writeSize = f->size - fileOffset < chunk ? static_cast<uint32_t>(f->size - fileOffset) : chunk;
+                f->f_write(static_cast<uint32_t>(fileOffset), ptr, writeSize, f->name);
+            }
+        }
+
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return totalWritten;
+}
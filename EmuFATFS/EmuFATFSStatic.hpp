@@ -0,0 +1,326 @@
+//
+//  EmuFATFSStatic.hpp
+//  EmuFATFS
+//
+//  FAT16 volume for a file set which is known at compile time
+//
+
+#ifndef EmuFATFSStatic_hpp
+#define EmuFATFSStatic_hpp
+
+#include "EmuFATFS.hpp"
+
+namespace tihmstar {
+
+/*
+    Image<files, bytesPerSector, sectorsPerCluster>::build() generates bootsector, FAT and root directory at compile time.
+    The result is byte identical to what EmuFATFS<..> (FAT16) generates for the same files added in the same order,
+    but lives in read-only memory, so there is no addFile() at boot and metadata reads are a plain memcpy.
+    Only file contents are still handed to the providers.
+
+        static constexpr EmuFATFSStatic::File gFiles[] = {
+            {"readme", "txt", 1234, readme_read_cb},
+            {"log", "bin", 0x100000, log_read_cb, log_write_cb},
+        };
+        static constexpr auto gImage = EmuFATFSStatic::Image<gFiles, 512, 8>::build("MYVOLUME");
+        static constexpr EmuFATFSStatic gFS(gImage);
+
+    Large images may need a higher constexpr step limit (e.g. clang -fconstexpr-steps).
+ */
+class EmuFATFSStatic {
+public:
+    struct File{
+        const char *name;   //root directory only, bad characters become '_' like in addFile()
+        const char *suffix; //NULL or up to 3 characters
+        uint32_t size;
+        EmuFATFSBase::cb_read f_read;
+        EmuFATFSBase::cb_write f_write; //NULL marks the file read-only
+    };
+
+    /*
+        What the accessors work with, independent of the Image it points into
+     */
+    struct Layout{
+        const File *files;
+        const uint32_t *clusterEnds;  //first cluster behind each file, ascending
+        const uint8_t *bootsector;    //first 512 bytes of sector 0
+        const uint8_t *fat;           //used start of the FAT, the rest is zero
+        const uint8_t *rootDirectory; //used start of the root directory, the rest is zero
+        uint32_t fatBytes;
+        uint32_t rootDirectoryBytes;
+        uint32_t totalSectors;
+        uint16_t fileCount;
+        uint8_t bytesPerSectorShift;
+        uint8_t sectorsPerClusterShift;
+    };
+
+private:
+    static constexpr uint32_t kFirstDataCluster = 2;
+    static constexpr uint32_t kClusterLimit = 0xFFF7;
+    static constexpr uint32_t kFAT16Threshold = 65525;
+    static constexpr uint8_t kLFNEntryChars = 13;
+    static constexpr uint32_t kDirectoryEntryBytes = 32;
+
+#pragma mark constexpr helpers
+    static constexpr uint8_t log2Floor(uint32_t v){
+        uint8_t ret = 0;
+        while (v >>= 1) ret++;
+        return ret;
+    }
+
+    static constexpr uint32_t cstrlen(const char *s){
+        uint32_t len = 0;
+        while (s[len]) len++;
+        return len;
+    }
+
+    static constexpr char upper(char c){
+        return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+
+    static constexpr void put(uint8_t *p, uint64_t v, uint8_t bytes){
+        for (uint8_t i=0; i<bytes; i++) p[i] = static_cast<uint8_t>(v >> (8*i));
+    }
+
+    static constexpr char nameChar(const File &f, uint32_t i){
+        for (const char *bad = "*?<>|\"\\/:"; *bad; bad++) {
+            if (f.name[i] == *bad) return '_';
+        }
+        return f.name[i];
+    }
+
+    //the suffix as addFile() stores it: 3 characters, padded with spaces
+    static constexpr char suffixChar(const File &f, uint8_t i){
+        if (!f.suffix) return ' ';
+        for (uint8_t j=0; j<i; j++) {
+            if (!f.suffix[j]) return ' ';
+        }
+        return f.suffix[i] ? f.suffix[i] : ' ';
+    }
+
+    static constexpr uint16_t longNameLength(const File &f){
+        uint32_t len = cstrlen(f.name);
+        if (suffixChar(f, 0) != ' ') {
+            len += 2;
+            for (uint8_t j=1; j<3 && suffixChar(f, j) != ' '; j++) len++;
+        }
+        return static_cast<uint16_t>(len);
+    }
+
+    static constexpr char longNameChar(const File &f, uint32_t i){
+        uint32_t nameLen = cstrlen(f.name);
+        if (i < nameLen) return nameChar(f, i);
+        if (i == nameLen) return '.';
+        return suffixChar(f, static_cast<uint8_t>(i - nameLen - 1));
+    }
+
+    static constexpr uint8_t lfnEntries(const File &f){
+        return static_cast<uint8_t>((longNameLength(f) + kLFNEntryChars-1) / kLFNEntryChars);
+    }
+
+    //zero sized files get no clusters (start cluster 0)
+    static constexpr uint32_t fileClusters(const File &f, uint8_t clusterShift){
+        return static_cast<uint32_t>(((uint64_t)f.size + (1u << clusterShift) - 1) >> clusterShift);
+    }
+
+    static constexpr uint32_t usedClusters(const File *files, uint16_t fileCount, uint8_t clusterShift){
+        uint32_t clusters = 0;
+        for (uint16_t i=0; i<fileCount; i++) clusters += fileClusters(files[i], clusterShift);
+        return clusters;
+    }
+
+    static constexpr uint32_t rootDirectoryEntries(const File *files, uint16_t fileCount){
+        uint32_t entries = 1; //volume label
+        for (uint16_t i=0; i<fileCount; i++) entries += 1 + lfnEntries(files[i]);
+        return entries;
+    }
+
+    static constexpr uint32_t totalSectors(uint8_t bytesPerSectorShift, uint8_t sectorsPerClusterShift){
+        return ((kFAT16Threshold*512) >> bytesPerSectorShift) << sectorsPerClusterShift;
+    }
+
+    static constexpr uint32_t clusterLimit(uint8_t bytesPerSectorShift, uint8_t sectorsPerClusterShift){
+        uint32_t dataSector = EmuFATFSBase::kReservedSectors + ((2*EmuFATFSBase::kFATBytes + EmuFATFSBase::kRootDirectoryBytes) >> bytesPerSectorShift);
+        uint32_t limit = kFirstDataCluster + ((totalSectors(bytesPerSectorShift, sectorsPerClusterShift) - dataSector) >> sectorsPerClusterShift);
+        return limit > kClusterLimit ? kClusterLimit : limit;
+    }
+
+    static constexpr bool validFiles(const File *files, uint16_t fileCount){
+        for (uint16_t i=0; i<fileCount; i++) {
+            if (!files[i].name || !files[i].name[0] || !files[i].f_read) return false;
+            for (const char *c = files[i].name; *c; c++) {
+                if (*c == '/') return false;
+            }
+            if (longNameLength(files[i]) > 255) return false;
+        }
+        return true;
+    }
+
+    /*
+        Same entries as EmuFATFSBase::buildEntrySet(): LFN entries (last one first), then the 8.3 entry
+     */
+    static constexpr uint32_t buildEntrySet(const File &f, uint16_t fileIdx, uint32_t startCluster, uint8_t *e){
+        uint32_t nameLen = cstrlen(f.name);
+        uint16_t longLen = longNameLength(f);
+        uint8_t lfnCnt = lfnEntries(f);
+        uint8_t *dfe = e + lfnCnt*kDirectoryEntryBytes;
+        uint8_t csum = 0;
+
+        for (uint8_t k=0; k<8; k++) dfe[k] = k < nameLen ? nameChar(f, k) : ' ';
+        if (nameLen > 8) {
+            //"~<fileIdx+1>", only its first digit fits
+            uint32_t num = fileIdx+1;
+            while (num >= 10) num /= 10;
+            dfe[6] = '~';
+            dfe[7] = static_cast<uint8_t>('0' + num);
+        }
+        for (uint8_t k=0; k<8; k++) {
+            dfe[k] = upper(dfe[k]);
+            if (dfe[k] == '.') dfe[k] = '_';
+        }
+        for (uint8_t z=0; z<3; z++) dfe[8+z] = upper(suffixChar(f, z));
+        dfe[11] = FILEENTRY_ATTR_SYSTEM | (f.f_write ? 0 : FILEENTRY_ATTR_READONLY);
+        put(&dfe[20], startCluster >> 16, 2);
+        put(&dfe[26], startCluster, 2);
+        put(&dfe[28], f.size, 4);
+
+        csum = dfe[0];
+        for (uint8_t k=1; k<11; k++) csum = static_cast<uint8_t>(((csum >> 1) | (csum << 7)) + dfe[k]);
+
+        for (uint8_t n=0; n<lfnCnt; n++) {
+            uint8_t *lfn = e + n*kDirectoryEntryBytes;
+            uint8_t seq = lfnCnt - n;
+            for (uint8_t k=0; k<kDirectoryEntryBytes; k++) lfn[k] = 0xFF;
+            lfn[0] = seq | (n == 0 ? LFN_ENTRY_LAST : 0);
+            lfn[11] = FILEENTRY_ATTR_LFN_ENTRY;
+            lfn[12] = 0;
+            lfn[13] = csum;
+            put(&lfn[26], 0, 2);
+            //name1 at 1, name2 at 14, name3 at 28; terminated by a single 0 if there is room, 0xFFFF padded
+            for (uint8_t j=0; j<kLFNEntryChars; j++) {
+                uint32_t pos = (seq-1)*kLFNEntryChars + j;
+                uint8_t off = j < 5 ? 1 + 2*j : (j < 11 ? 14 + 2*(j-5) : 28 + 2*(j-11));
+                char16_t c = pos < longLen ? static_cast<char16_t>(longNameChar(f, pos)) : 0;
+                put(&lfn[off], c, 2);
+                if (pos >= longLen) break;
+            }
+        }
+        return (lfnCnt+1)*kDirectoryEntryBytes;
+    }
+
+public:
+    template <const auto &files, uint16_t bytesPerSector, uint8_t sectorsPerCluster>
+    struct Image{
+        static constexpr uint16_t kFileCount = sizeof(files)/sizeof(*files);
+        static constexpr uint8_t kBytesPerSectorShift = log2Floor(bytesPerSector);
+        static constexpr uint8_t kSectorsPerClusterShift = log2Floor(sectorsPerCluster);
+        static constexpr uint8_t kClusterShift = kBytesPerSectorShift + kSectorsPerClusterShift;
+        static constexpr uint32_t kUsedClusters = usedClusters(files, kFileCount, kClusterShift);
+        static constexpr uint32_t kRootDirectoryEntries = rootDirectoryEntries(files, kFileCount);
+
+        static_assert(bytesPerSector >= 512 && bytesPerSector <= 4096 && (bytesPerSector & (bytesPerSector-1)) == 0, "bytesPerSector needs to be a power of 2 between 512 and 4096");
+        static_assert(sectorsPerCluster && sectorsPerCluster <= 128 && (sectorsPerCluster & (sectorsPerCluster-1)) == 0, "sectorsPerCluster needs to be a power of 2 up to 128");
+        static_assert(kFileCount < EmuFATFSBase::kNoFile, "Too many files");
+        static_assert(validFiles(files, kFileCount), "Files need a name without '/' (up to 255 characters with suffix) and a read function");
+        static_assert(kFirstDataCluster + kUsedClusters <= clusterLimit(kBytesPerSectorShift, kSectorsPerClusterShift), "Not enough sectors left to store files");
+        static_assert(kRootDirectoryEntries*kDirectoryEntryBytes <= EmuFATFSBase::kRootDirectoryBytes, "Not enough root directory entries left");
+
+        uint8_t bootsector[512];
+        uint8_t fat[(kFirstDataCluster + kUsedClusters)*2];
+        uint8_t rootDirectory[kRootDirectoryEntries*kDirectoryEntryBytes];
+        uint32_t clusterEnds[kFileCount];
+
+        static constexpr Image build(const char *volumeLabel = NULL){
+            Image img{};
+            char label[11] = {};
+            uint8_t *bs = img.bootsector;
+            uint32_t nextCluster = kFirstDataCluster;
+            uint32_t pos = 0;
+
+            //same normalization as the EmuFATFSBase constructor: upper case, space padded
+            if (!volumeLabel) volumeLabel = "EmuFATFS16";
+            for (uint8_t i=0, end=0; i<sizeof(label); i++) {
+                if (!end && !volumeLabel[i]) end = 1;
+                label[i] = end ? ' ' : upper(volumeLabel[i]);
+            }
+
+            bs[0] = 0xeb; bs[1] = 0x3c; bs[2] = 0x90;
+            for (uint8_t i=0; i<8; i++) bs[3+i] = "EmuFATFS"[i];
+            put(&bs[11], bytesPerSector, 2);
+            bs[13] = sectorsPerCluster;
+            put(&bs[14], EmuFATFSBase::kReservedSectors, 2);
+            bs[16] = 2; //numberOfFATs
+            put(&bs[17], EmuFATFSBase::kRootDirectoryBytes / kDirectoryEntryBytes, 2);
+            bs[21] = 0xF8; //fixed disk
+            put(&bs[22], EmuFATFSBase::kFATBytes >> kBytesPerSectorShift, 2);
+            put(&bs[24], 1, 2); //physSectorsPerTrack
+            put(&bs[26], 1, 2); //numberOfHeads
+            put(&bs[32], totalSectors(kBytesPerSectorShift, kSectorsPerClusterShift), 4);
+            bs[38] = 0x29; //extendedBootSignature
+            put(&bs[39], 0x6d686974, 4);
+            for (uint8_t i=0; i<11; i++) bs[43+i] = label[i];
+            for (uint8_t i=0; i<8; i++) bs[54+i] = "FAT16   "[i];
+            put(&bs[510], 0xaa55, 2);
+
+            put(&img.fat[0], 0xfff8, 2);
+            put(&img.fat[2], 0x8000, 2);
+
+            for (uint8_t i=0; i<11; i++) img.rootDirectory[i] = label[i];
+            img.rootDirectory[11] = FILEENTRY_ATTR_VOLUME_LABEL;
+            pos = kDirectoryEntryBytes;
+
+            for (uint16_t i=0; i<kFileCount; i++) {
+                uint32_t clusters = fileClusters(files[i], kClusterShift);
+                uint32_t startCluster = clusters ? nextCluster : 0;
+                for (uint32_t c=nextCluster; c<nextCluster+clusters; c++) {
+                    put(&img.fat[2*c], c+1 == nextCluster+clusters ? 0xFFFF : c+1, 2);
+                }
+                nextCluster += clusters;
+                img.clusterEnds[i] = nextCluster;
+                pos += buildEntrySet(files[i], i, startCluster, &img.rootDirectory[pos]);
+            }
+            return img;
+        }
+
+        constexpr Layout layout() const{
+            return {
+                .files = files,
+                .clusterEnds = clusterEnds,
+                .bootsector = bootsector,
+                .fat = fat,
+                .rootDirectory = rootDirectory,
+                .fatBytes = sizeof(fat),
+                .rootDirectoryBytes = sizeof(rootDirectory),
+                .totalSectors = totalSectors(kBytesPerSectorShift, kSectorsPerClusterShift),
+                .fileCount = kFileCount,
+                .bytesPerSectorShift = kBytesPerSectorShift,
+                .sectorsPerClusterShift = kSectorsPerClusterShift,
+            };
+        }
+    };
+
+private:
+    const Layout _layout;
+
+    uint32_t dataRegionChunk(uint64_t offset, uint32_t size, uint16_t *outFileIdx, uint64_t *outFileOffset) const;
+
+public:
+    constexpr EmuFATFSStatic(const Layout &layout) : _layout{layout} {}
+    template <const auto &files, uint16_t bytesPerSector, uint8_t sectorsPerCluster>
+    constexpr EmuFATFSStatic(const Image<files, bytesPerSector, sectorsPerCluster> &image) : _layout{image.layout()} {}
+
+    uint64_t volumeBytes() const;
+    uint32_t bytesPerCluster() const;
+
+    /*
+        Same contract as EmuFATFSBase::hostRead/hostWrite.
+        The image is read-only: host writes to bootsector, FATs and root directory are dropped,
+        data region writes go to the provider of the file (clipped to its size).
+     */
+    int32_t hostRead(uint64_t offset, void *buf, uint32_t size) const;
+    int32_t hostWrite(uint64_t offset, const void *buf, uint32_t size) const;
+};
+
+}
+
+#endif /* EmuFATFSStatic_hpp */
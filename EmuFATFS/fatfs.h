@@ -42,16 +42,44 @@ typedef struct {
     char                filesystemType[8];
 } ATTRIBUTE_PACKED FAT_BPB_DOS4_00_t;
 
+typedef struct {
+    FAT_BPB_DOS3_31_t   dos3;
+    uint32_t            sectorsPerFAT;
+    uint16_t            extFlags;
+    uint16_t            fsVersion;
+    uint32_t            rootDirectoryCluster;
+    uint16_t            fsInfoSector;
+    uint16_t            backupBootSector;
+    uint8_t             reserved[12];
+    uint8_t             physDriveNumber;
+    uint8_t             flags;
+    uint8_t             extendedBootSignature;
+    uint32_t            volumeSerialNumber;
+    char                volumeLabel[11];
+    char                filesystemType[8];
+} ATTRIBUTE_PACKED FAT_BPB_FAT32_t;
+
 typedef struct{
-    uint8_t jumpInsn[3]; //eb 3c 90
+    uint8_t jumpInsn[3]; //eb 3c 90 (FAT32: eb 58 90)
     char oemName[8];
     union {
         FAT_BPB_DOS4_00_t dos4;
+        FAT_BPB_FAT32_t fat32;
         uint8_t __pad[0x1f3];
     };
     uint16_t signature; //0xaa55 
 } ATTRIBUTE_PACKED FAT_Bootsector_t;
 
+typedef struct{
+    uint32_t leadSignature; //0x41615252
+    uint8_t  reserved1[480];
+    uint32_t structSignature; //0x61417272
+    uint32_t freeClusters;
+    uint32_t nextFreeCluster;
+    uint8_t  reserved2[12];
+    uint32_t trailSignature; //0xaa550000
+} ATTRIBUTE_PACKED FAT_FSInfo_t;
+
 
 typedef struct{
     uint16_t day  : 5;
@@ -93,9 +121,104 @@ typedef struct{
     char16_t name3[2];
 } ATTRIBUTE_PACKED FAT_DirectoryTableLFNEntry_t;
 
+#pragma mark exFAT
+typedef struct{
+    uint8_t jumpInsn[3]; //eb 76 90
+    char filesystemName[8]; //"EXFAT   "
+    uint8_t mustBeZero[53];
+    uint64_t partitionOffset;
+    uint64_t volumeLength;
+    uint32_t fatOffset;
+    uint32_t fatLength;
+    uint32_t clusterHeapOffset;
+    uint32_t clusterCount;
+    uint32_t firstClusterOfRootDirectory;
+    uint32_t volumeSerialNumber;
+    uint16_t filesystemRevision;
+    uint16_t volumeFlags;
+    uint8_t bytesPerSectorShift;
+    uint8_t sectorsPerClusterShift;
+    uint8_t numberOfFATs;
+    uint8_t driveSelect;
+    uint8_t percentInUse;
+    uint8_t reserved[7];
+    uint8_t bootCode[390];
+    uint16_t signature; //0xaa55
+} ATTRIBUTE_PACKED exFAT_Bootsector_t;
+
+typedef struct{
+    uint8_t entryType; //0x83
+    uint8_t characterCount;
+    char16_t volumeLabel[11];
+    uint8_t reserved[8];
+} ATTRIBUTE_PACKED exFAT_VolumeLabelEntry_t;
+
+typedef struct{
+    uint8_t entryType; //0x81 (bitmap) or 0x82 (up-case table)
+    uint8_t flags;
+    uint8_t reserved1[2];
+    uint32_t tableChecksum; //up-case table only
+    uint8_t reserved2[12];
+    uint32_t firstCluster;
+    uint64_t dataLength;
+} ATTRIBUTE_PACKED exFAT_AllocationEntry_t;
+
+typedef struct{
+    uint8_t entryType; //0x85
+    uint8_t secondaryCount;
+    uint16_t setChecksum;
+    uint16_t fileAttributes;
+    uint16_t reserved1;
+    uint32_t createTimestamp;
+    uint32_t modifiedTimestamp;
+    uint32_t accessedTimestamp;
+    uint8_t create10ms;
+    uint8_t modified10ms;
+    uint8_t createUtcOffset;
+    uint8_t modifiedUtcOffset;
+    uint8_t accessedUtcOffset;
+    uint8_t reserved2[7];
+} ATTRIBUTE_PACKED exFAT_FileEntry_t;
+
+typedef struct{
+    uint8_t entryType; //0xc0
+    uint8_t flags;
+    uint8_t reserved1;
+    uint8_t nameLength;
+    uint16_t nameHash;
+    uint16_t reserved2;
+    uint64_t validDataLength;
+    uint32_t reserved3;
+    uint32_t firstCluster;
+    uint64_t dataLength;
+} ATTRIBUTE_PACKED exFAT_StreamExtensionEntry_t;
+
+typedef struct{
+    uint8_t entryType; //0xc1
+    uint8_t flags;
+    char16_t name[15];
+} ATTRIBUTE_PACKED exFAT_FileNameEntry_t;
+
+#define EXFAT_ENTRY_VOLUME_LABEL    0x83
+#define EXFAT_ENTRY_BITMAP          0x81
+#define EXFAT_ENTRY_UPCASE          0x82
+#define EXFAT_ENTRY_FILE            0x85
+#define EXFAT_ENTRY_STREAM          0xc0
+#define EXFAT_ENTRY_FILENAME        0xc1
+
+#define EXFAT_FLAG_ALLOCATION_POSSIBLE  (1 << 0)
+#define EXFAT_FLAG_NO_FAT_CHAIN         (1 << 1)
+
+#define EXFAT_FILENAME_ENTRY_MAX_NAME_LEN 15
+
 typedef union {
     FAT_DirectoryTableFileEntry_t   dfe;
     FAT_DirectoryTableLFNEntry_t    lfn;
+    exFAT_VolumeLabelEntry_t        exLabel;
+    exFAT_AllocationEntry_t         exAlloc;
+    exFAT_FileEntry_t               exFile;
+    exFAT_StreamExtensionEntry_t    exStream;
+    exFAT_FileNameEntry_t           exName;
 } ATTRIBUTE_PACKED FAT_DirectoryTableEntry_t;
 
 #define FILEENTRY_ATTR_READONLY     (1 << 0)
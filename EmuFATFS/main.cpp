@@ -7,59 +7,237 @@
 
 #include "EmuFATFS.hpp"
 
-#include <libgeneral/macros.h>
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
+using namespace tihmstar;
 
-int32_t info_read_cb(uint32_t foffset, void *buf, uint32_t bufSize, const char *filaneme){
-    char content[] = "Hello world file!!";
-    if (bufSize > sizeof(content)) bufSize = sizeof(content);
-    
-    memcpy(buf, content, bufSize);
-    return bufSize;
-}
+#define EXPORT_MAX_FILES        0x400
+#define EXPORT_FILENAMES_SIZE   0x10000
+#define EXPORT_BATCH_SIZE       0x400000 //bytes per hostRead
+#define EXPORT_HOLE_GRANULE     0x1000 //all zero runs of this size are left as holes
+#define EXPORT_MAX_EXTENTS      0x40
+
+typedef EmuFATFS<EXPORT_MAX_FILES, EXPORT_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeFAT16> ExportFAT16;
+typedef EmuFATFS<EXPORT_MAX_FILES, EXPORT_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeFAT32> ExportFAT32;
+typedef EmuFATFS<EXPORT_MAX_FILES, EXPORT_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeExFAT> ExportExFAT;
 
-void cb_newFile(const char *filename, const char filenameSuffix[3], uint32_t fileSize){
+struct ExportStats{
+    std::atomic<uint64_t> dataBytes;
+    std::atomic<uint64_t> holeBytes;
+};
 
-  printf("",filename,filenameSuffix);
+static int32_t file_read_cb(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size){
+    ssize_t didRead = pread((int)(intptr_t)ctx, buf, size, (off_t)offset);
+    return didRead < 0 ? -1 : (int32_t)didRead;
 }
 
+static bool isZero(const uint8_t *buf, size_t size){
+    //first byte zero and every byte equal to its successor
+    return size == 0 || (buf[0] == 0 && memcmp(buf, buf+1, size-1) == 0);
+}
 
-int main(int argc, const char * argv[]) {
-    info("%s",VERSION_STRING);
-    
-    tihmstar::EmuFATFS fs;
-    
-    fs.addFile("hello world.txt", NULL, 0x1000000, info_read_cb);
-    fs.registerNewfileCallback(cb_newFile);
-    {
-        uint8_t buf[0x2000];
-        FILE *f=fopen("/Users/tihmstar/Desktop/ptr.bin","rb");
-        fread(buf, 1, sizeof(buf), f);
-        fclose(f);
-        fs.catchRootDirectoryAccess(0,buf, sizeof(buf));
+static int writeSparse(int fd, uint64_t offset, const uint8_t *buf, size_t size, ExportStats *stats){
+    size_t runStart = 0;
+    size_t pos = 0;
+
+    /*
+        The image was truncated to its full size up front, so skipping a range leaves a hole.
+        Only runs with data are written.
+     */
+    while (pos < size) {
+        size_t granule = size - pos < EXPORT_HOLE_GRANULE ? size - pos : EXPORT_HOLE_GRANULE;
+        bool zero = isZero(&buf[pos], granule);
+        if (zero || pos + granule == size) {
+            size_t runEnd = zero ? pos : pos + granule;
+            while (runStart < runEnd) {
+                ssize_t didWrite = pwrite(fd, &buf[runStart], runEnd - runStart, (off_t)(offset + runStart));
+                if (didWrite <= 0) return -1;
+                stats->dataBytes += didWrite;
+                runStart += didWrite;
+            }
+            if (zero) {
+                stats->holeBytes += granule;
+                runStart = pos + granule;
+            }
+        }
+        pos += granule;
     }
-    
-    
-    FILE *f = fopen("disk.bin", "wb");
-    uint64_t totalRead = 0;
-    uint64_t maxReadSize = 0x600000;
-    while (totalRead < maxReadSize) {
-        uint8_t buf[0x200];
-        int32_t didread = 0;
-        uint32_t needsRead = sizeof(buf);
-        if (needsRead > maxReadSize - totalRead) needsRead = (uint32_t)(maxReadSize - totalRead);
-        didread = fs.hostRead((uint32_t)totalRead, buf, needsRead);
-        if (didread <= 0 ) break;
-        fwrite(buf, 1, didread, f);
-        totalRead += didread;
+    return 0;
+}
+
+template <class FS>
+static int exportBatch(FS *fs, int outFd, uint64_t offset, uint32_t size, uint8_t *buf, ExportStats *stats){
+    EmuFATFSBase::DiskExtent extents[EXPORT_MAX_EXTENTS];
+    uint64_t end = offset + size;
+
+    //only ranges which may hold data get generated, the rest stays a hole without being read
+    while (offset < end) {
+        int cnt = fs->queryExtents(offset, end - offset, extents, EXPORT_MAX_EXTENTS);
+        if (cnt <= 0) return -1;
+        for (int i=0; i<cnt; i++) {
+            const EmuFATFSBase::DiskExtent *ext = &extents[i];
+            if (ext->type != EmuFATFSBase::kExtentData) {
+                stats->holeBytes += ext->length;
+                continue;
+            }
+            if (fs->hostRead(ext->offset, buf, (uint32_t)ext->length) != (int32_t)ext->length) return -1;
+            if (writeSparse(outFd, ext->offset, buf, (size_t)ext->length, stats)) return -1;
+        }
+        offset = extents[cnt-1].offset + extents[cnt-1].length;
     }
-    fclose(f);
-    
-    info("wrote 0x%llx bytes",totalRead);
-    
-    
-    info("Done");
     return 0;
 }
+
+template <class FS>
+static int exportImage(FS *fs, int outFd, unsigned threads, ExportStats *stats){
+    uint64_t total = (uint64_t)fs->diskBlockNum() * fs->diskBlockSize();
+    std::atomic<uint64_t> nextBatch{0};
+    std::atomic<int> failed{0};
+    std::vector<std::thread> workers;
+
+    if (ftruncate(outFd, (off_t)total)) {
+        fprintf(stderr, "Failed to size image to %llu bytes: %s\n", (unsigned long long)total, strerror(errno));
+        return -1;
+    }
+    //after this hostRead only reads, so the workers can share the instance
+    fs->prepareSharedReads();
+
+    for (unsigned i=0; i<threads; i++) {
+        workers.emplace_back([&]{
+            std::vector<uint8_t> buf(EXPORT_BATCH_SIZE);
+            while (!failed) {
+                uint64_t offset = nextBatch.fetch_add(EXPORT_BATCH_SIZE);
+                uint32_t size = EXPORT_BATCH_SIZE;
+                if (offset >= total) break;
+                if (size > total - offset) size = (uint32_t)(total - offset);
+                if (exportBatch(fs, outFd, offset, size, buf.data(), stats)) failed = 1;
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    return failed ? -1 : 0;
+}
+
+template <class FS>
+static int buildAndExport(const char *label, uint16_t bytesPerSector, char * const *files, int fileCnt, int outFd, unsigned threads, ExportStats *stats){
+    FS *fs = new FS(label, bytesPerSector);
+    std::vector<int> fds;
+    int err = 0;
+
+    for (int i=0; i<fileCnt; i++) {
+        //"source=name/in/volume", the name defaults to the basename of source
+        char src[0x400];
+        const char *name = NULL;
+        const char *sep = strchr(files[i], '=');
+        struct stat st = {};
+        int fd = -1;
+
+        snprintf(src, sizeof(src), "%.*s", sep ? (int)(sep - files[i]) : (int)strlen(files[i]), files[i]);
+        name = sep ? sep+1 : (strrchr(src, '/') ? strrchr(src, '/')+1 : src);
+        if ((fd = open(src, O_RDONLY)) < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "Failed to open %s: %s\n", src, strerror(errno));
+            if (fd >= 0) close(fd);
+            err = -1;
+            break;
+        }
+        fds.push_back(fd);
+        if ((err = fs->addFile(name, NULL, (uint64_t)st.st_size, file_read_cb, NULL, (void*)(intptr_t)fd))) {
+            fprintf(stderr, "Failed to add %s (%d)\n", name, err);
+            break;
+        }
+    }
+    if (!err) err = exportImage(fs, outFd, threads, stats);
+    delete fs;
+    for (int fd : fds) close(fd);
+    return err;
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options] <image> [file[=name/in/volume] ...]\n", prog);
+    printf("Exports an emulated volume holding the given files as sparse disk image\n");
+    printf("  -t, --type <fat16|fat32|exfat>  volume type (default fat16)\n");
+    printf("  -b, --sector-size <bytes>       bytes per sector (default 512)\n");
+    printf("  -l, --label <label>             volume label\n");
+    printf("  -j, --jobs <n>                  worker threads (default: all cores)\n");
+}
+
+int main(int argc, char * const argv[]) {
+    static struct option longopts[] = {
+        { "type",           required_argument,  NULL, 't' },
+        { "sector-size",    required_argument,  NULL, 'b' },
+        { "label",          required_argument,  NULL, 'l' },
+        { "jobs",           required_argument,  NULL, 'j' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *type = "fat16";
+    const char *label = "EMUFATFS";
+    uint32_t bytesPerSector = 512; //checked before it's narrowed for the constructor
+    unsigned threads = std::thread::hardware_concurrency();
+    ExportStats stats = {};
+    int outFd = -1;
+    int err = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, argv, "t:b:l:j:h", longopts, NULL)) > 0) {
+        switch (opt) {
+            case 't': type = optarg; break;
+            case 'b': bytesPerSector = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'l': label = optarg; break;
+            case 'j': threads = (unsigned)strtoul(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!threads) threads = 1;
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || (bytesPerSector & (bytesPerSector-1))) {
+        fprintf(stderr, "Sector size needs to be 512, 1024, 2048 or 4096\n");
+        return 1;
+    }
+
+    if ((outFd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    {
+        auto start = std::chrono::steady_clock::now();
+        char * const *files = &argv[optind+1];
+        int fileCnt = argc - optind - 1;
+
+        if (!strcmp(type, "fat16")) {
+            err = buildAndExport<ExportFAT16>(label, (uint16_t)bytesPerSector, files, fileCnt, outFd, threads, &stats);
+        }else if (!strcmp(type, "fat32")) {
+            err = buildAndExport<ExportFAT32>(label, (uint16_t)bytesPerSector, files, fileCnt, outFd, threads, &stats);
+        }else if (!strcmp(type, "exfat")) {
+            err = buildAndExport<ExportExFAT>(label, (uint16_t)bytesPerSector, files, fileCnt, outFd, threads, &stats);
+        }else{
+            fprintf(stderr, "Unknown volume type %s\n", type);
+            err = -1;
+        }
+
+        if (!err) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            printf("Wrote %s: %llu bytes of data, %llu bytes left as holes in %.2fs (%u threads)\n", argv[optind],
+                   (unsigned long long)stats.dataBytes, (unsigned long long)stats.holeBytes, seconds, threads);
+        }
+    }
+    close(outFd);
+    return err ? 1 : 0;
+}
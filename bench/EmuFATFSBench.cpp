@@ -0,0 +1,259 @@
+//
+//  EmuFATFSBench.cpp
+//  EmuFATFS
+//
+//  hostRead/hostWrite micro benchmarks, one CSV row per measurement:
+//  benchmark,region,files,sector_size,request_size,ops,ns_per_op,mb_per_s,extra
+//
+
+#include "EmuFATFS.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+using namespace tihmstar;
+
+#define BENCH_MAX_FILES     4096 //files + the subdirectories holding the ones which don't fit into the root
+#define BENCH_ROOT_FILES    2000 //every entry takes a LFN + 8.3 slot, the FAT16 root holds 4096 slots
+#define BENCH_DIR_FILES     1000
+#define BENCH_FILE_SIZE     0x4000
+
+typedef EmuFATFS<BENCH_MAX_FILES, BENCH_MAX_FILES*16, 0, 8> BenchFS;
+
+static double gMinSeconds = 0.05;
+static uint64_t gProviderCalls = 0;
+static uint32_t gProviderDelay = 0; //busy loop iterations, simulates a slow backend
+
+static int32_t pattern_read_cb(uint32_t offset, void *buf, uint32_t size, const char *filename){
+    uint8_t *ptr = (uint8_t*)buf;
+    gProviderCalls++;
+    for (volatile uint32_t i=0; i<gProviderDelay; i++);
+    for (uint32_t i=0; i<size; i++) ptr[i] = (uint8_t)(offset + i);
+    return size;
+}
+
+static int32_t discard_write_cb(uint32_t offset, const void *buf, uint32_t size, const char *filename){
+    return size;
+}
+
+static void report(const char *benchmark, const char *region, uint32_t files, uint32_t sectorSize, uint32_t requestSize, uint64_t ops, double seconds, uint64_t extra){
+    double nsPerOp = seconds * 1e9 / (double)ops;
+    double mbPerSec = (double)ops * requestSize / seconds / (1024.0*1024.0);
+    printf("%s,%s,%u,%u,%u,%llu,%.1f,%.1f,%llu\n", benchmark, region, files, sectorSize, requestSize,
+           (unsigned long long)ops, nsPerOp, mbPerSec, (unsigned long long)extra);
+    fflush(stdout);
+}
+
+//fixed FAT16 layout, the bench volumes don't pin the sector size at compile time
+static uint64_t rootDirectoryOffset(uint16_t sectorSize){
+    return (uint64_t)EmuFATFSBase::kReservedSectors*sectorSize + 2*EmuFATFSBase::kFATBytes;
+}
+
+static uint64_t dataRegionOffset(uint16_t sectorSize){
+    return rootDirectoryOffset(sectorSize) + EmuFATFSBase::kRootDirectoryBytes;
+}
+
+/*
+    Files fill the root first, the rest goes into subdirectories. Their clusters are placed behind the files,
+    so file i always starts at cluster i*clustersPerFile of the data region.
+ */
+static BenchFS *makeVolume(uint32_t files, uint16_t sectorSize){
+    BenchFS *fs = new BenchFS("BENCH", sectorSize);
+    for (uint32_t i=0; i<files; i++) {
+        char name[32];
+        if (i < BENCH_ROOT_FILES) snprintf(name, sizeof(name), "file%04u", i);
+        else snprintf(name, sizeof(name), "more%u/file%04u", (i-BENCH_ROOT_FILES)/BENCH_DIR_FILES, i);
+        if (fs->addFile(name, "bin", BENCH_FILE_SIZE, pattern_read_cb, discard_write_cb)) {
+            fprintf(stderr, "Failed to add file %u\n", i);
+            exit(1);
+        }
+    }
+    return fs;
+}
+
+/*
+    Runs op until gMinSeconds passed (at least minOps times), returns the elapsed seconds
+ */
+template <class F>
+static double timeOps(uint64_t *outOps, uint64_t minOps, F op){
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    uint64_t ops = 0;
+    do {
+        for (uint64_t i=0; i<minOps; i++) op(ops++);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < gMinSeconds);
+    *outOps = ops;
+    return seconds;
+}
+
+static void benchRegions(uint32_t files, uint16_t sectorSize, const std::vector<uint32_t> &requestSizes){
+    BenchFS *fs = makeVolume(files, sectorSize);
+    uint64_t fatOffset = (uint64_t)EmuFATFSBase::kReservedSectors*sectorSize;
+    uint64_t rootOffset = rootDirectoryOffset(sectorSize);
+    uint64_t dataOffset = dataRegionOffset(sectorSize);
+    uint32_t bytesPerCluster = fs->bytesPerCluster();
+    uint32_t clustersPerFile = (BENCH_FILE_SIZE + bytesPerCluster-1) / bytesPerCluster;
+    std::vector<uint8_t> buf(requestSizes.back());
+    struct {
+        const char *name;
+        uint64_t offset;
+    } regions[] = {
+        {"boot", 0},
+        {"fat", fatOffset},
+        {"rootdir", rootOffset},
+    };
+
+    fs->finalize();
+    for (uint32_t requestSize : requestSizes) {
+        uint64_t ops = 0;
+        double seconds = 0;
+        for (auto &region : regions) {
+            seconds = timeOps(&ops, 64, [&](uint64_t){ fs->hostRead(region.offset, buf.data(), requestSize); });
+            report("hostRead", region.name, files, sectorSize, requestSize, ops, seconds, 0);
+        }
+
+        //spread over all files, so the cluster lookup can't stay on one entry
+        gProviderCalls = 0;
+        seconds = timeOps(&ops, 64, [&](uint64_t i){
+            uint64_t file = (i * 2654435761u) % files;
+            fs->hostRead(dataOffset + file*clustersPerFile*bytesPerCluster, buf.data(), requestSize);
+        });
+        report("hostRead", "data", files, sectorSize, requestSize, ops, seconds, gProviderCalls);
+    }
+
+    {
+        //the host rewriting the first root directory sector unchanged, e.g. when it updates the access date
+        std::vector<uint8_t> sector(sectorSize);
+        uint64_t ops = 0;
+        double seconds = 0;
+        fs->hostRead(rootOffset, sector.data(), sectorSize);
+        seconds = timeOps(&ops, 16, [&](uint64_t){ fs->hostWrite(rootOffset, sector.data(), sectorSize); });
+        report("hostWrite", "rootdir", files, sectorSize, sectorSize, ops, seconds, 0);
+    }
+
+    {
+        //the whole directory written back with a single entry changed (the size of the last file)
+        std::vector<uint8_t> dir(EmuFATFSBase::kRootDirectoryBytes);
+        uint64_t ops = 0;
+        double seconds = 0;
+        uint32_t lastEntry = 0;
+        fs->hostRead(rootOffset, dir.data(), (uint32_t)dir.size());
+        for (uint32_t i=0; i<dir.size(); i+=32) {
+            //file entries only, the size of a directory or LFN slot means nothing
+            if (dir[i] && !(dir[i+11] & (FILEENTRY_ATTR_VOLUME_LABEL | FILEENTRY_ATTR_SUBDIR))) lastEntry = i;
+        }
+        seconds = timeOps(&ops, 4, [&](uint64_t i){
+            dir[lastEntry+28] = (uint8_t)i;
+            fs->hostWrite(rootOffset, dir.data(), (uint32_t)dir.size());
+        });
+        report("hostWrite", "rootdir_full", files, sectorSize, (uint32_t)dir.size(), ops, seconds, 0);
+    }
+    delete fs;
+}
+
+static void benchCallsPerMiB(uint16_t sectorSize, const std::vector<uint32_t> &requestSizes){
+    BenchFS *fs = makeVolume(64, sectorSize);
+    std::vector<uint8_t> buf(requestSizes.back());
+
+    //transport round trips needed to read the first MiB (boot sector, FATs, ...)
+    for (uint32_t requestSize : requestSizes) {
+        uint64_t calls = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t offset=0; offset<0x100000; calls++) {
+            int32_t didRead = fs->hostRead(offset, buf.data(), requestSize);
+            if (didRead <= 0) break;
+            offset += didRead;
+        }
+        report("read1MiB", "metadata", 64, sectorSize, requestSize, calls,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), calls);
+    }
+    delete fs;
+}
+
+static void benchReadAhead(uint16_t sectorSize){
+    static EmuFATFSBase::ReadAheadSlot slots[8];
+    static uint8_t pool[8*0x4000];
+    const uint32_t requestSize = 0x1000;
+
+    for (int withReadAhead=0; withReadAhead<2; withReadAhead++) {
+        BenchFS *fs = new BenchFS("BENCH", sectorSize);
+        uint64_t dataOffset = dataRegionOffset(sectorSize);
+        std::vector<uint8_t> buf(requestSize);
+        uint64_t ops = 0;
+        double seconds = 0;
+
+        fs->addFile("stream", "bin", 0x800000, pattern_read_cb);
+        if (withReadAhead) fs->registerReadAhead(slots, 8, pool, 0x4000);
+        fs->finalize();
+        gProviderCalls = 0;
+        gProviderDelay = 2000;
+        //sequential stream through the file, prefetch() runs where the transport would idle
+        seconds = timeOps(&ops, 32, [&](uint64_t i){
+            fs->hostRead(dataOffset + (i * requestSize) % 0x800000, buf.data(), requestSize);
+            while (fs->prefetch());
+        });
+        gProviderDelay = 0;
+        report("readahead", withReadAhead ? "on" : "off", 1, sectorSize, requestSize, ops, seconds, gProviderCalls);
+        delete fs;
+    }
+}
+
+static void benchReadCache(uint16_t sectorSize){
+    static EmuFATFSBase::ReadCacheArena<32, 0x1000> arena;
+    const uint32_t requestSize = 512;
+
+    for (int withCache=0; withCache<2; withCache++) {
+        BenchFS *fs = new BenchFS("BENCH", sectorSize);
+        uint64_t dataOffset = dataRegionOffset(sectorSize);
+        std::vector<uint8_t> buf(requestSize);
+        uint64_t ops = 0;
+        double seconds = 0;
+
+        fs->addFile("hot", "bin", 0x800000, pattern_read_cb);
+        if (withCache) fs->registerReadCache(&arena);
+        fs->finalize();
+        gProviderCalls = 0;
+        gProviderDelay = 2000;
+        //rereads of a small working set (directory probes, thumbnails), 16 of the 32 blocks
+        seconds = timeOps(&ops, 32, [&](uint64_t i){
+            uint64_t block = (i * 2654435761u) % 16;
+            fs->hostRead(dataOffset + block*0x10000 + (i % 8)*requestSize, buf.data(), requestSize);
+        });
+        gProviderDelay = 0;
+        report("readcache", withCache ? "on" : "off", 1, sectorSize, requestSize, ops, seconds, gProviderCalls);
+        delete fs;
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    std::vector<uint32_t> fileCounts = {1, 5, 64, 512, 2000, 4000};
+    std::vector<uint16_t> sectorSizes = {512, 1024, 4096};
+    std::vector<uint32_t> requestSizes = {512, 0x1000, 0x10000, 0x80000};
+
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            gMinSeconds = 0.005;
+            fileCounts = {1, 4000};
+            sectorSizes = {512, 4096};
+            requestSizes = {512, 0x10000};
+        }else{
+            printf("Usage: %s [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("benchmark,region,files,sector_size,request_size,ops,ns_per_op,mb_per_s,extra\n");
+    for (uint16_t sectorSize : sectorSizes) {
+        for (uint32_t files : fileCounts) {
+            benchRegions(files, sectorSize, requestSizes);
+        }
+        benchCallsPerMiB(sectorSize, requestSizes);
+        benchReadAhead(sectorSize);
+        benchReadCache(sectorSize);
+    }
+    return 0;
+}
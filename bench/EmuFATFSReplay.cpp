@@ -0,0 +1,302 @@
+//
+//  EmuFATFSReplay.cpp
+//  EmuFATFS
+//
+//  Drives an EmuFATFS instance from an access trace (see EmuFATFSBase::registerTrace) and reports
+//  throughput and latency percentiles per operation as CSV:
+//  op,count,bytes,seconds,mb_per_s,p50_ns,p90_ns,p99_ns,p999_ns,max_ns
+//
+//  Capturing on a device: write traceHeader() once, then for every trace callback the record
+//  followed by size payload bytes for writes. Traces are little endian, like the hosts this runs on.
+//
+
+#include "EmuFATFS.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace tihmstar;
+
+#define REPLAY_MAX_FILES        0x400
+#define REPLAY_FILENAMES_SIZE   0x10000
+
+typedef EmuFATFS<REPLAY_MAX_FILES, REPLAY_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeFAT16> ReplayFAT16;
+typedef EmuFATFS<REPLAY_MAX_FILES, REPLAY_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeFAT32> ReplayFAT32;
+typedef EmuFATFS<REPLAY_MAX_FILES, REPLAY_FILENAMES_SIZE, 0, 0, EmuFATFSBase::kVolumeTypeExFAT> ReplayExFAT;
+
+struct ReplayOptions{
+    uint32_t syntheticFiles;
+    uint64_t syntheticSize;
+    unsigned repeat;
+    bool realtime;
+    char * const *files;
+    int fileCnt;
+};
+
+struct OpResults{
+    std::vector<uint64_t> latencies; //ns
+    uint64_t bytes;
+    double seconds;
+};
+
+static int32_t pattern_read_cb(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size){
+    uint8_t *ptr = (uint8_t*)buf;
+    for (uint32_t i=0; i<size; i++) ptr[i] = (uint8_t)(offset + i + fileIdx);
+    return size;
+}
+
+static int32_t file_read_cb(void *ctx, uint16_t fileIdx, uint64_t offset, void *buf, uint32_t size){
+    ssize_t didRead = pread((int)(intptr_t)ctx, buf, size, (off_t)offset);
+    return didRead < 0 ? -1 : (int32_t)didRead;
+}
+
+static int32_t discard_write_cb(void *ctx, uint16_t fileIdx, uint64_t offset, const void *buf, uint32_t size){
+    //replayed writes must not touch the source files
+    return size;
+}
+
+static int loadTrace(const char *path, std::vector<uint8_t> *trace){
+    struct stat st = {};
+    int fd = -1;
+    int err = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    trace->resize((size_t)st.st_size);
+    for (size_t pos = 0; pos < trace->size();) {
+        ssize_t didRead = read(fd, trace->data() + pos, trace->size() - pos);
+        if (didRead <= 0) {
+            fprintf(stderr, "Failed to read %s\n", path);
+            err = -1;
+            break;
+        }
+        pos += didRead;
+    }
+    close(fd);
+    return err;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)(p * (sorted.size()-1) + 0.5);
+    return sorted[idx];
+}
+
+static void report(const char *op, OpResults *res){
+    std::vector<uint64_t> &lat = res->latencies;
+    std::sort(lat.begin(), lat.end());
+    printf("%s,%zu,%llu,%.3f,%.1f,%llu,%llu,%llu,%llu,%llu\n", op, lat.size(), (unsigned long long)res->bytes, res->seconds,
+           res->seconds > 0 ? res->bytes / res->seconds / (1024.0*1024.0) : 0.0,
+           (unsigned long long)percentile(lat, 0.5), (unsigned long long)percentile(lat, 0.9), (unsigned long long)percentile(lat, 0.99),
+           (unsigned long long)percentile(lat, 0.999), (unsigned long long)(lat.empty() ? 0 : lat.back()));
+}
+
+template <class FS>
+static int addFiles(FS *fs, const ReplayOptions *opts, std::vector<int> *fds){
+    int err = 0;
+
+    for (uint32_t i=0; i<opts->syntheticFiles; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%04u.bin", i);
+        if ((err = fs->addFile(name, NULL, opts->syntheticSize, pattern_read_cb, discard_write_cb, NULL))) {
+            fprintf(stderr, "Failed to add %s (%d)\n", name, err);
+            return err;
+        }
+    }
+    for (int i=0; i<opts->fileCnt; i++) {
+        //"source=name/in/volume", the name defaults to the basename of source
+        char src[0x400];
+        const char *arg = opts->files[i];
+        const char *sep = strchr(arg, '=');
+        const char *name = NULL;
+        struct stat st = {};
+        int fd = -1;
+
+        snprintf(src, sizeof(src), "%.*s", sep ? (int)(sep - arg) : (int)strlen(arg), arg);
+        name = sep ? sep+1 : (strrchr(src, '/') ? strrchr(src, '/')+1 : src);
+        if ((fd = open(src, O_RDONLY)) < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "Failed to open %s: %s\n", src, strerror(errno));
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        fds->push_back(fd);
+        if ((err = fs->addFile(name, NULL, (uint64_t)st.st_size, file_read_cb, discard_write_cb, (void*)(intptr_t)fd))) {
+            fprintf(stderr, "Failed to add %s (%d)\n", name, err);
+            return err;
+        }
+    }
+    return 0;
+}
+
+template <class FS>
+static int replay(const EmuFATFSBase::TraceHeader *header, const uint8_t *records, size_t recordsSize, uint16_t bytesPerSector, const ReplayOptions *opts){
+    OpResults results[2] = {};
+    std::vector<uint8_t> buf;
+    std::vector<int> fds;
+    FS *fs = new FS("REPLAY", bytesPerSector);
+    int err = 0;
+
+    if ((err = addFiles(fs, opts, &fds))) goto error;
+
+    {
+        EmuFATFSBase::TraceHeader layout = {};
+        fs->traceHeader(&layout, header->ticksPerSecond);
+        if (layout.volumeBytes != header->volumeBytes || layout.sectorsPerClusterShift != header->sectorsPerClusterShift) {
+            fprintf(stderr, "Warning: layout differs from the traced volume (%llu bytes, %u sectors per cluster, traced %llu bytes, %u)\n",
+                    (unsigned long long)layout.volumeBytes, 1u << layout.sectorsPerClusterShift,
+                    (unsigned long long)header->volumeBytes, 1u << header->sectorsPerClusterShift);
+        }
+    }
+
+    for (unsigned r=0; r<opts->repeat; r++) {
+        auto replayStart = std::chrono::steady_clock::now();
+        uint64_t firstTimestamp = 0;
+        size_t pos = 0;
+
+        while (pos + sizeof(EmuFATFSBase::TraceRecord) <= recordsSize) {
+            EmuFATFSBase::TraceRecord record;
+            const uint8_t *payload = NULL;
+            bool isWrite = false;
+
+            memcpy(&record, &records[pos], sizeof(record));
+            pos += sizeof(record);
+            isWrite = record.op == EmuFATFSBase::kTraceWrite;
+            if (isWrite) {
+                if (recordsSize - pos < record.size) {
+                    fprintf(stderr, "Trace truncated in a write payload\n");
+                    err = -1;
+                    goto error;
+                }
+                payload = &records[pos];
+                pos += record.size;
+            }else if (record.op != EmuFATFSBase::kTraceRead) {
+                fprintf(stderr, "Unknown trace op %u\n", record.op);
+                err = -1;
+                goto error;
+            }
+            if (buf.size() < record.size) buf.resize(record.size);
+
+            if (opts->realtime && header->ticksPerSecond) {
+                //keep the traced gaps between requests, the host idle time is where read-ahead would run
+                if (!firstTimestamp) firstTimestamp = record.timestamp;
+                double due = (double)(record.timestamp - firstTimestamp) / header->ticksPerSecond;
+                std::this_thread::sleep_until(replayStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(due)));
+            }
+
+            {
+                auto start = std::chrono::steady_clock::now();
+                if (isWrite) fs->hostWrite(record.offset, payload, record.size);
+                else fs->hostRead(record.offset, buf.data(), record.size);
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                OpResults *res = &results[isWrite ? 1 : 0];
+                res->latencies.push_back((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                res->bytes += record.size;
+                res->seconds += std::chrono::duration<double>(elapsed).count();
+            }
+        }
+    }
+
+    printf("op,count,bytes,seconds,mb_per_s,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    report("read", &results[0]);
+    report("write", &results[1]);
+
+error:
+    delete fs;
+    for (int fd : fds) close(fd);
+    return err;
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options] <trace> [file[=name/in/volume] ...]\n", prog);
+    printf("Replays an access trace against an emulated volume holding the given files\n");
+    printf("  -t, --type <fat16|fat32|exfat>  volume type (default: as traced)\n");
+    printf("  -b, --sector-size <bytes>       bytes per sector (default: as traced)\n");
+    printf("  -n, --files <n>                 add n synthetic files in front of the given ones\n");
+    printf("  -s, --file-size <bytes>         size of the synthetic files (default 1MiB)\n");
+    printf("  -r, --repeat <n>                replay the trace n times\n");
+    printf("      --realtime                  keep the traced gaps between requests\n");
+}
+
+int main(int argc, char * const argv[]) {
+    static struct option longopts[] = {
+        { "type",           required_argument,  NULL, 't' },
+        { "sector-size",    required_argument,  NULL, 'b' },
+        { "files",          required_argument,  NULL, 'n' },
+        { "file-size",      required_argument,  NULL, 's' },
+        { "repeat",         required_argument,  NULL, 'r' },
+        { "realtime",       no_argument,        NULL, 'R' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    ReplayOptions opts = {0, 0x100000, 1, false, NULL, 0};
+    EmuFATFSBase::TraceHeader header = {};
+    std::vector<uint8_t> trace;
+    const char *type = NULL;
+    uint16_t bytesPerSector = 0;
+    int err = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, argv, "t:b:n:s:r:h", longopts, NULL)) > 0) {
+        switch (opt) {
+            case 't': type = optarg; break;
+            case 'b': bytesPerSector = (uint16_t)strtoul(optarg, NULL, 0); break;
+            case 'n': opts.syntheticFiles = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 's': opts.syntheticSize = strtoull(optarg, NULL, 0); break;
+            case 'r': opts.repeat = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'R': opts.realtime = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.files = &argv[optind+1];
+    opts.fileCnt = argc - optind - 1;
+
+    if (loadTrace(argv[optind], &trace)) return 1;
+    if (trace.size() < sizeof(header)) {
+        fprintf(stderr, "Trace too short\n");
+        return 1;
+    }
+    memcpy(&header, trace.data(), sizeof(header));
+    if (memcmp(header.magic, "EFTR", sizeof(header.magic)) || header.version != EmuFATFSBase::kTraceVersion) {
+        fprintf(stderr, "Not a version %u trace\n", EmuFATFSBase::kTraceVersion);
+        return 1;
+    }
+    if (!bytesPerSector) bytesPerSector = header.bytesPerSector;
+    if (!type) {
+        type = header.volumeType == EmuFATFSBase::kVolumeTypeExFAT ? "exfat" : (header.volumeType == EmuFATFSBase::kVolumeTypeFAT32 ? "fat32" : "fat16");
+    }
+
+    {
+        const uint8_t *records = trace.data() + sizeof(header);
+        size_t recordsSize = trace.size() - sizeof(header);
+        if (!strcmp(type, "fat16")) {
+            err = replay<ReplayFAT16>(&header, records, recordsSize, bytesPerSector, &opts);
+        }else if (!strcmp(type, "fat32")) {
+            err = replay<ReplayFAT32>(&header, records, recordsSize, bytesPerSector, &opts);
+        }else if (!strcmp(type, "exfat")) {
+            err = replay<ReplayExFAT>(&header, records, recordsSize, bytesPerSector, &opts);
+        }else{
+            fprintf(stderr, "Unknown volume type %s\n", type);
+            err = -1;
+        }
+    }
+    return err ? 1 : 0;
+}